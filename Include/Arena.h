@@ -0,0 +1,165 @@
+#pragma once
+#include "Common.h"
+
+/**
+ * 地址空间预留模式（MEMORYPOOL_ARENA）：
+ * 启动时一次性预留一整段连续的虚拟地址（PROT_NONE，不占物理内存），
+ * PC扩充时从低到高切出一段并改为可读写，整个堆都落在[base, base + bytes)中。
+ * 这样页号到span的映射可以用一个以(addr - base) >> PAGE_SHIFT为下标的平坦数组，
+ * 判断指针是否属于本分配器也只需要一次区间比较
+ */
+class Arena
+{
+public:
+    /**
+     * @param bytes 预留的字节数，按区域（1MB）取整，首地址也按区域对齐
+     */
+    explicit Arena(size_t bytes)
+    {
+        size_t regionPages = PAGE_NUM - 1;
+        _pages = ((bytes >> PAGE_SHIFT) + regionPages - 1) / regionPages * regionPages;
+        _base = (uintptr_t) SystemReserve(_pages, regionPages);
+    }
+
+    /**
+     * 从预留区中按地址从低到高切出kpage页，并提交为可读写
+     * @param kpage 页数
+     * @param alignPages 首地址对齐的页数（2的幂）
+     * @param skipped 为对齐而跳过的页数，这些页同样已提交，紧挨在返回地址之前
+     * @return 首地址；预留区用完时抛出std::bad_alloc
+     */
+    void *Alloc(size_t kpage, size_t alignPages, size_t &skipped)
+    {
+        size_t basePage = _base >> PAGE_SHIFT;
+        size_t top = _top.load(std::memory_order_relaxed);
+        size_t start;
+        do
+        {
+            start = ((basePage + top + alignPages - 1) & ~(alignPages - 1)) - basePage;
+            if (start + kpage > _pages)
+            {
+                throw std::bad_alloc();
+            }
+        } while (!_top.compare_exchange_weak(top, start + kpage, std::memory_order_relaxed));
+
+        skipped = start - top;
+        SystemCommitReserved((void *) (_base + (top << PAGE_SHIFT)), skipped + kpage);
+        return (void *) (_base + (start << PAGE_SHIFT));
+    }
+
+    // ptr是否落在预留区中
+    bool IsOwned(const void *ptr) const
+    {
+        return (uintptr_t) ptr - _base < (_pages << PAGE_SHIFT);
+    }
+
+    size_t BasePageId() const
+    {
+        return _base >> PAGE_SHIFT;
+    }
+
+    size_t Pages() const
+    {
+        return _pages;
+    }
+
+private:
+    uintptr_t _base = 0; // 预留区首地址
+    size_t _pages = 0; // 预留区页数
+    std::atomic<size_t> _top{0}; // 已切出的页数
+};
+
+/**
+ * 预留区的页号到span的映射：一个平坦数组，下标为页号减去预留区首页号
+ * 数组本身也只预留地址空间，第一次写入某一页时才由内核分配物理页，
+ * 64GB的预留区对应64MB的数组地址空间，实际占用只与用过的页数成正比。
+ * get只有一次减法、一次比较和一次访存
+ */
+class ArenaPageMap
+{
+public:
+    ArenaPageMap(size_t basePageId, size_t npages)
+        : _base(basePageId), _length(npages)
+    {
+        size_t kpage = (npages * sizeof(void *) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        _values = (std::atomic<void *> *) SystemReserve(kpage, 1);
+        SystemCommitReserved(_values, kpage);
+
+        size_t classPages = (npages * sizeof(PageTag) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        _classes = (std::atomic<PageTag> *) SystemReserve(classPages, 1);
+        SystemCommitReserved(_classes, classPages);
+    }
+
+    // 数组在构造时已整体提交，不需要预先开辟
+    void Ensure(size_t start, size_t n)
+    {
+        (void) start;
+        (void) n;
+    }
+
+    // 建立映射关系，pageId必须在预留区内
+    void set(size_t pageId, void *span)
+    {
+        assert(pageId - _base < _length);
+        _values[pageId - _base].store(span, std::memory_order_relaxed);
+        _classes[pageId - _base].store(0, std::memory_order_relaxed); // 页的归属变了，原来登记的尺寸类作废
+    }
+
+    // 登记小对象页的尺寸类（桶下标 + 1），调用前该页必须已经set过
+    void setClass(size_t pageId, size_t cls)
+    {
+        assert(pageId - _base < _length);
+        _classes[pageId - _base].store((PageTag) cls, std::memory_order_relaxed);
+    }
+
+    // 读取尺寸类，0表示该页不属于小对象span，不加锁
+    size_t getClass(size_t pageId) const
+    {
+        return getTag(pageId) & PAGE_TAG_CLASS_MASK;
+    }
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 登记最近从该页所在span取块的TC编号，与尺寸类放在同一个标记里，调用前该页必须已经setClass过
+    void setOwner(size_t pageId, uint32_t owner)
+    {
+        assert(pageId - _base < _length);
+        std::atomic<PageTag> &tag = _classes[pageId - _base];
+        tag.store((PageTag) owner << PAGE_TAG_CLASS_BITS | (tag.load(std::memory_order_relaxed) & PAGE_TAG_CLASS_MASK),
+                  std::memory_order_relaxed);
+    }
+
+    // 读取TC编号，0表示没有登记，不加锁
+    uint32_t getOwner(size_t pageId) const
+    {
+        return getTag(pageId) >> PAGE_TAG_CLASS_BITS;
+    }
+#endif
+
+    // 获取映射关系，预留区之外的页号返回nullptr，不需要加锁
+    void *get(size_t pageId) const
+    {
+        size_t i = pageId - _base;
+        if (i >= _length)
+        {
+            return nullptr;
+        }
+        return _values[i].load(std::memory_order_relaxed);
+    }
+
+private:
+    // 读取每页的标记，预留区之外的页号返回0
+    PageTag getTag(size_t pageId) const
+    {
+        size_t i = pageId - _base;
+        if (i >= _length)
+        {
+            return 0;
+        }
+        return _classes[i].load(std::memory_order_relaxed);
+    }
+
+    size_t _base; // 预留区首页号
+    size_t _length; // 预留区页数
+    std::atomic<void *> *_values; // 映射数组
+    std::atomic<PageTag> *_classes; // 每页的标记（尺寸类，远程释放模式下还有TC编号），与_values平行
+};
@@ -1,16 +1,20 @@
 #pragma once
-#include <valarray>
+#include <new>
 
 #include "Common.h"
+#include "Stats.h"
 
 class CentralCache
 {
 public:
     // 单例模式，局部静态变量模式
+    // 对象用定位new构造在静态存储上，进程退出时不析构：
+    // 其它静态对象的析构函数里仍可能释放内存，注册析构函数本身也可能调用malloc
     static CentralCache *getInstance()
     {
-        static CentralCache _sInst;
-        return &_sInst;
+        alignas(CentralCache) static char _sStorage[sizeof(CentralCache)];
+        static CentralCache *_sInst = new(_sStorage) CentralCache;
+        return _sInst;
     }
 
     CentralCache(const CentralCache &copy) = delete;
@@ -18,14 +22,24 @@ public:
     CentralCache &operator =(const CentralCache &copy) = delete;
 
     /**
-     * CC给TC分配空间：从指定桶中选取一个非空span，将该span的自由链表给TC
-     * @param start [out] 返回的大内存块起始地址
-     * @param end [out] 返回的大内存块终止地址
+     * CC给TC分配空间：优先从传输缓存拷走，否则从指定桶中选取一个非空span，从该span的自由链表上取块
+     * @param ptrs [out] 块指针写入的数组，长度至少为batchNum
      * @param batchNum [in] TC请求的内存块数量
      * @param size [in] size为TC需要的单块内存块字节数
-     * @return actualNum 返回CC实际提供的大小（span可用块数量可能小于TC请求的数量）
+     * @param owner [in] 取块的TC编号，远程释放模式下登记到span和它的各页上（为0或从传输缓存取走时不登记）
+     * @return actualNum 返回CC实际提供的大小（传输缓存或span可用块数量可能小于TC请求的数量）
      */
-    size_t FetchRangeObj(void *&start, void *&end, size_t batchNum, size_t size);
+    size_t FetchRangeObj(void **ptrs, size_t batchNum, size_t size, uint32_t owner = 0);
+
+    /**
+     * TC归还一段块指针给CC。传输缓存放得下时整段memcpy进去，
+     * 下一个来取的TC可以直接拷走，不需要遍历span、也不需要查基数树；
+     * 否则走ReleaseListToSpans逐块归还
+     * @param ptrs 块指针数组
+     * @param n 内存块数量
+     * @param size 内存块大小
+     */
+    void ReleaseRangeObj(void *const *ptrs, size_t n, size_t size);
 
     // CC获取一个非空的span，从中选取内存分配给TC
     // 两种情况，自身有 or 需向PC申请
@@ -38,10 +52,23 @@ public:
      * 这里主要涉及如何将内存块和页号对应，换算出页号就能找出对应的span
      * 【任意地址右移13位（除以8K），得到的就是页号】
      * span管理的空间页范围为：[_pageID,_pageID+_n)
-     * @param start 自由链表头
+     * @param ptrs 块指针数组
+     * @param n 内存块数量
      * @param size 内存块大小
      */
-    void ReleaseListToSpans(void *start, size_t size);
+    void ReleaseListToSpans(void *const *ptrs, size_t n, size_t size);
+
+    /**
+     * 把所有传输缓存中的块还给各自的span，变空的span还给PC
+     * @return 交出的字节数
+     */
+    size_t ReleaseTransferCaches();
+
+    /**
+     * 统计CC中空闲的块：传输缓存按块数、span中的按计数读取，不遍历span的自由链表
+     * @param stats [in/out] 累加到这里
+     */
+    void CollectStats(MemoryPoolStats &stats);
 
     //DeBug:打印桶中非空span数量，打印非空span内存块数量
     void PrintDebugInfo()
@@ -55,7 +82,8 @@ public:
                 std::unique_lock<std::mutex> lock(_spanLists[i].mtx);
 
                 // 打印桶级别的汇总信息
-                std::cout << "Bucket " << i << ": " << _spanLists[i].Size() << " spans" << std::endl;
+                std::cout << "Bucket " << i << ": " << _spanLists[i].Size() << " spans, "
+                        << _transferCaches[i].count << " objects in transfer cache" << std::endl;
 
                 // 遍历当前桶中的每一个 Span
                 Span *span = _spanLists[i].Begin();
@@ -85,12 +113,39 @@ public:
 
 private:
     //私有化构造函数，禁用拷贝、直接构造
-    CentralCache() = default;
+    // 构造时为所有桶的传输缓存申请指针数组
+    CentralCache();
 
 private:
     // 以SpanList为元素的哈希表
     // 除了基础元素不同，其余逻辑与TC中一致
     SpanList _spanLists[FREE_LIST_NUM];
+
+    // 传输缓存：每个桶一个指针数组栈，缓存TC还回来的块。
+    // 进出都是一次memcpy，用自旋锁保护，不需要桶锁
+    struct TransferCache
+    {
+        SpinLock lock;
+        size_t count = 0; // 当前缓存的块数
+        size_t capacity = 0; // 最多缓存的块数，为TransferCapacity批
+        void **slots = nullptr;
+    };
+
+    TransferCache _transferCaches[FREE_LIST_NUM];
+
+    // 每个桶的span中还没分给TC的块数，在桶锁内修改，统计时不加锁读取
+    OwnedCounter _spanFreeObjs[FREE_LIST_NUM];
+
+    // 每个桶最多缓存多少批：批数不超过TRANSFER_BATCH_NUM，
+    // 总字节数不超过TRANSFER_CACHE_BYTES（但至少一批），避免大块在这里囤积太多内存
+    static size_t TransferCapacity(size_t index)
+    {
+        size_t batchBytes = SizeClass::ClassBatch(index) * SizeClass::Size(index);
+        size_t cap = TRANSFER_CACHE_BYTES / batchBytes;
+        if (cap < 1) cap = 1;
+        if (cap > TRANSFER_BATCH_NUM) cap = TRANSFER_BATCH_NUM;
+        return cap;
+    }
 };
 
 
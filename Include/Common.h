@@ -3,6 +3,10 @@
 #include<iostream>
 #include<vector>
 #include<mutex>
+#include<thread>
+#include<atomic>
+#include<cstdint>
+#include<cstring>
 
 
 using std::cout;
@@ -13,22 +17,63 @@ constexpr size_t FREE_LIST_NUM = 208; // 哈希表中自由链表个数/桶数
 constexpr size_t MAX_BYTES = 256 * 1024; // ThreadCache单次分配给线程最大字节数
 constexpr size_t PAGE_NUM = 129; // PageCash中最大的span控制的页数（这里为129是为了下标和桶能直接映射）
 constexpr size_t PAGE_SHIFT = 13; // 一页的位数，这里一页设为8K，13位
+constexpr size_t TRANSFER_BATCH_NUM = 16; // CC传输缓存中每个桶最多缓存的批数
+constexpr size_t TRANSFER_CACHE_BYTES = 1024 * 1024; // CC传输缓存中每个桶最多缓存的字节数
+constexpr size_t THREAD_CACHE_TOTAL_BYTES = 32 * 1024 * 1024; // 所有TC缓存字节数的默认总预算
+constexpr size_t THREAD_CACHE_MIN_BYTES = 64 * 1024; // 单个TC的最小预算：新TC先领这么多（还有未分配的预算时），偷取/收回时也至少给它留这么多
+constexpr size_t THREAD_CACHE_STEAL_BYTES = 64 * 1024; // 每次扩大/偷取预算的步长
+constexpr size_t THREAD_CACHE_STEAL_PROBES = 8; // 每次偷取预算最多查看的TC个数
+constexpr size_t THREAD_CACHE_MAX_UNDERFLOWS = 3; // TC的桶连续取空这么多次后，MaxSize增加一批
+constexpr size_t THREAD_CACHE_MAX_OVERAGES = 3; // TC的桶连续溢出这么多次后，MaxSize减少一批
+constexpr size_t THREAD_CACHE_RELEASE_MS = 100; // TC按低水位归还空闲块的周期（毫秒）
+constexpr size_t CPU_CACHE_FAST_BYTES = 16 * 1024; // 每CPU缓存快路径中每个桶的栈最多缓存的字节数
+constexpr size_t CPU_CACHE_CHECK_INTERVAL = 64; // 每CPU缓存的快路径每补充/归还这么多次，检查一次预算和空闲
+constexpr size_t HEAP_GROW_MIN_BYTES = 4 * 1024 * 1024; // PC第一次向系统申请的字节数
+constexpr size_t HEAP_GROW_MAX_BYTES = 64 * 1024 * 1024; // PC每次向系统申请的字节数上限（按倍数增长到此为止）
+constexpr size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024; // 透明大页的大小
+#ifdef MEMORYPOOL_ARENA_BYTES
+constexpr size_t ARENA_BYTES = (size_t) MEMORYPOOL_ARENA_BYTES; // 地址空间预留模式下一次性预留的字节数
+#else
+constexpr size_t ARENA_BYTES = (size_t) 64 << 30;
+#endif
+constexpr size_t PROFILE_SAMPLE_BYTES = 2 * 1024 * 1024; // 堆分析器（MEMORYPOOL_PROFILER）默认平均每申请这么多字节采样一次
+constexpr size_t PROFILE_MAX_DEPTH = 32; // 堆分析器记录的调用栈最大深度
+constexpr size_t REMOTE_OWNER_NUM = 1 << 16; // 远程释放模式下TC编号的个数（编号0表示没有登记）
+
+// 页号映射中与Span*平行的每页标记：低8位是尺寸类（桶下标 + 1），
+// 远程释放模式下高位是最近从该页所在span取块的TC编号，释放时与尺寸类一起读出，不必访问Span
+#ifdef MEMORYPOOL_REMOTE_FREE
+typedef uint32_t PageTag;
+#else
+typedef uint8_t PageTag;
+#endif
+constexpr int PAGE_TAG_CLASS_BITS = 8;
+constexpr PageTag PAGE_TAG_CLASS_MASK = 0xff;
+
+// 分配器作为LD_PRELOAD库时位于初始TLS块中，initial-exec模型访问TLS不需要调用__tls_get_addr
+#if defined(__GNUC__) && !defined(_WIN32)
+#define MEMORYPOOL_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define MEMORYPOOL_TLS_MODEL
+#endif
 
 
 
 // 根据不同的操作系统引入底层的系统 API 头文件
 #ifdef _WIN32
 #include <Windows.h>
+#include <intrin.h>
 #else
 #include <sys/mman.h>
 #include <unistd.h>
 #endif
 
-// 直接去堆上按页申请物理/虚拟内存
-inline static void* SystemAlloc(size_t kpage)
+// 直接去堆上按页申请物理/虚拟内存，起始地址按 alignPages 页对齐
+inline static void* SystemAllocAligned(size_t kpage, size_t alignPages)
 {
     // 1. 将“页数”转换为真实的“字节数”
     size_t size = kpage << PAGE_SHIFT;
+    size_t alignBytes = alignPages << PAGE_SHIFT;
     void* ptr = nullptr;
 
 #ifdef _WIN32
@@ -37,7 +82,23 @@ inline static void* SystemAlloc(size_t kpage)
     // 参数2: size 申请的总字节数
     // 参数3: MEM_COMMIT | MEM_RESERVE 表示同时保留地址空间并提交物理内存
     // 参数4: PAGE_READWRITE 表示这块内存可读可写
-    ptr = VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    // VirtualAlloc 的地址天然按64KB对齐，超过64KB的对齐要求需要先保留一段更大的地址，
+    // 算出对齐后的地址，释放后再在该地址上重新申请（期间可能被其它线程抢占，因此重试几次）
+    if (alignBytes <= 64 * 1024)
+    {
+        ptr = VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    } else
+    {
+        for (int i = 0; i < 8 && ptr == nullptr; ++i)
+        {
+            void* base = VirtualAlloc(0, size + alignBytes, MEM_RESERVE, PAGE_NOACCESS);
+            if (base == nullptr)
+                break;
+            size_t aligned = ((size_t) base + alignBytes - 1) & ~(alignBytes - 1);
+            VirtualFree(base, 0, MEM_RELEASE);
+            ptr = VirtualAlloc((void*) aligned, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        }
+    }
 #else
     // Linux/macOS 平台 API：mmap (Memory Mapped)
     // 参数1: NULL 表示让操作系统自动选择地址
@@ -46,13 +107,33 @@ inline static void* SystemAlloc(size_t kpage)
     // 参数4: MAP_PRIVATE | MAP_ANONYMOUS 匿名私有映射（不映射到磁盘文件，纯当物理内存用）
     // 参数5: -1 (因为是匿名映射，不需要文件描述符 fd)
     // 参数6: 0 (偏移量)
-    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    //
+    // 注意：mmap 只保证按系统页（通常4KB）对齐，而这里的一页是8KB，
+    // 上层会用 ptr >> PAGE_SHIFT 计算页号，地址不按8KB对齐会导致span的
+    // 首部落到映射区之外。因此多申请一段对齐长度，再把首尾多余的部分 munmap 掉
+    size_t mapSize = size + alignBytes;
+    ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
     // Linux 下 mmap 失败不会返回 nullptr，而是返回 MAP_FAILED (即 (void*)-1)
     // 这里做一次统一的抹平处理
     if (ptr == MAP_FAILED)
     {
         ptr = nullptr;
+    } else
+    {
+        size_t addr = (size_t) ptr;
+        size_t aligned = (addr + alignBytes - 1) & ~(alignBytes - 1);
+        size_t head = aligned - addr; // 首部多余的字节
+        size_t tail = mapSize - head - size; // 尾部多余的字节
+        if (head > 0)
+        {
+            munmap(ptr, head);
+        }
+        if (tail > 0)
+        {
+            munmap((char *) aligned + size, tail);
+        }
+        ptr = (void *) aligned;
     }
 #endif
 
@@ -65,6 +146,12 @@ inline static void* SystemAlloc(size_t kpage)
     return ptr;
 }
 
+// 直接去堆上按页申请物理/虚拟内存
+inline static void* SystemAlloc(size_t kpage)
+{
+    return SystemAllocAligned(kpage, 1);
+}
+
 // 将内存彻底还给操作系统
 inline static void SystemFree(void* ptr, size_t kpage)
 {
@@ -80,6 +167,211 @@ inline static void SystemFree(void* ptr, size_t kpage)
 #endif
 }
 
+// 把物理内存还给操作系统，但保留虚拟地址空间（span仍由PC管理）
+inline static void SystemDecommit(void* ptr, size_t kpage)
+{
+    size_t size = kpage << PAGE_SHIFT;
+
+#ifdef _WIN32
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+#elif defined(MADV_DONTNEED)
+    // MADV_DONTNEED 会立即释放物理页，RSS马上下降；再次访问时内核按需补零页，
+    // 比 MADV_FREE 更符合“空闲内存必须真正还回去”的预期
+    madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
+// 重新提交已归还的内存。Linux下访问时会自动缺页补回，不需要任何操作
+inline static void SystemCommit(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+    VirtualAlloc(ptr, kpage << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE);
+#else
+    (void) ptr;
+    (void) kpage;
+#endif
+}
+
+// 只预留一段按 alignPages 页对齐的虚拟地址空间，不可访问、不占物理内存也不计入提交量
+// 使用前需要先用 SystemCommitReserved 把其中的一部分变为可读写
+inline static void* SystemReserve(size_t kpage, size_t alignPages)
+{
+    size_t size = kpage << PAGE_SHIFT;
+    size_t alignBytes = alignPages << PAGE_SHIFT;
+    void* ptr = nullptr;
+
+#ifdef _WIN32
+    // 与SystemAllocAligned相同：先多保留一段算出对齐地址，释放后在该地址上重新保留
+    for (int i = 0; i < 8 && ptr == nullptr; ++i)
+    {
+        void* base = VirtualAlloc(0, size + alignBytes, MEM_RESERVE, PAGE_NOACCESS);
+        if (base == nullptr)
+            break;
+        size_t aligned = ((size_t) base + alignBytes - 1) & ~(alignBytes - 1);
+        VirtualFree(base, 0, MEM_RELEASE);
+        ptr = VirtualAlloc((void*) aligned, size, MEM_RESERVE, PAGE_NOACCESS);
+    }
+#else
+    // PROT_NONE + MAP_NORESERVE：只占地址空间，不受overcommit限制
+    size_t mapSize = size + alignBytes;
+    ptr = mmap(NULL, mapSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        ptr = nullptr;
+    } else
+    {
+        size_t addr = (size_t) ptr;
+        size_t aligned = (addr + alignBytes - 1) & ~(alignBytes - 1);
+        size_t head = aligned - addr;
+        size_t tail = mapSize - head - size;
+        if (head > 0)
+        {
+            munmap(ptr, head);
+        }
+        if (tail > 0)
+        {
+            munmap((char *) aligned + size, tail);
+        }
+        ptr = (void *) aligned;
+    }
+#endif
+
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+// 把预留的地址空间变为可读写。Linux下物理页仍在第一次访问时才分配
+inline static void SystemCommitReserved(void* ptr, size_t kpage)
+{
+    bool ok;
+#ifdef _WIN32
+    ok = VirtualAlloc(ptr, kpage << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    ok = mprotect(ptr, kpage << PAGE_SHIFT, PROT_READ | PROT_WRITE) == 0;
+#endif
+    if (!ok)
+    {
+        throw std::bad_alloc();
+    }
+}
+
+// 建议内核用2MB透明大页支撑这段内存，减少TLB缺失。只是建议，内核不支持或关闭了THP时没有效果
+// 首地址和长度按2MB对齐时效果最好
+inline static void SystemHugePages(void* ptr, size_t kpage)
+{
+#if defined(MADV_HUGEPAGE)
+    madvise(ptr, kpage << PAGE_SHIFT, MADV_HUGEPAGE);
+#else
+    (void) ptr;
+    (void) kpage;
+#endif
+}
+
+
+
+// 最低位的1所在的下标（x不能为0），编译成一条tzcnt/bsf指令
+inline size_t CountTrailingZeros(uint64_t x)
+{
+    assert(x != 0);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+#else
+    return (size_t) __builtin_ctzll(x);
+#endif
+}
+
+
+// 自旋锁：只用于临界区极短（几条指令）的场景，比如CC的传输缓存
+// 提供lock/unlock，可以直接配合std::lock_guard使用
+class SpinLock
+{
+private:
+    std::atomic<bool> _locked{false};
+
+    // 自旋这么多次还没拿到锁，说明持有者多半被抢占了，改为让出CPU
+    static const int SPIN_LIMIT = 64;
+
+    // 告诉CPU正在自旋等待：x86上降低功耗并让出超线程的执行资源
+    static void CpuRelax()
+    {
+#if defined(_WIN32)
+        YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield" ::: "memory");
+#endif
+    }
+
+public:
+    // 先只读等待锁变空闲再尝试交换（test-and-test-and-set），等待时不反复抢占缓存行；
+    // 持有者被抢占时（线程数多于核数）不再空转整个时间片，而是让出CPU
+    void lock()
+    {
+        int spins = 0;
+        while (_locked.exchange(true, std::memory_order_acquire))
+        {
+            while (_locked.load(std::memory_order_relaxed))
+            {
+                if (++spins < SPIN_LIMIT)
+                {
+                    CpuRelax();
+                } else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        _locked.store(false, std::memory_order_release);
+    }
+};
+
+// 只有一个写者（本线程，或持有锁的线程）、其它线程随时可能读的计数器。
+// 写入是relaxed的load + store，不需要带lock前缀的原子读改写，和普通变量一样便宜；
+// 统计时其它线程不加锁读到的是某个时刻的近似值
+class OwnedCounter
+{
+private:
+    std::atomic<size_t> _value{0};
+
+public:
+    OwnedCounter &operator +=(size_t n)
+    {
+        _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        return *this;
+    }
+
+    OwnedCounter &operator -=(size_t n)
+    {
+        _value.store(_value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+        return *this;
+    }
+
+    OwnedCounter &operator =(size_t n)
+    {
+        _value.store(n, std::memory_order_relaxed);
+        return *this;
+    }
+
+    operator size_t() const
+    {
+        return _value.load(std::memory_order_relaxed);
+    }
+};
 
 
 //获取obj指向的内存块中存储的指针
@@ -90,84 +382,100 @@ inline void *&ObjNext(void *obj)
 }
 
 
-// 自由链表
+// 自由链表：TC每个桶的块缓存
+// 用指针数组实现的栈，而不是把next指针写在块里的侵入式链表：
+// Push/Pop只访问连续的指针数组，释放的块本身在热路径上不会被读写（不会把冷块拉进缓存）；
+// 与CC之间的整段进出也是连续数组的memcpy，不需要逐个沿着next指针遍历
+// 数组由TC统一向系统申请后通过Init分给各个桶
 class FreeList
 {
 private:
-    void *_freeList = nullptr; //这里用void*类型了，之前定长的时候使用char*
+    void **_slots = nullptr; // 指针数组，_slots[_size - 1]是栈顶
+    size_t _capacity = 0; // 数组容量，TC保证_maxSize不超过它
+    size_t _size = 0; //当前缓存的块数
 
     // 每个线程的TC的【每个槽位】都有一个这个，这个东西限制了当前线程
     // 申请特定大小最大内存块数
     // 随着慢启动，TC某个大小的块需求越多，这个也会逐渐增加
-    // 但显然不可能允许它一直往上加，因此有@SizeClass::NumMoveSize去计算上限
+    // 慢启动到一批之后，还会随取空/溢出的情况在[一批, 容量]之间增减，空闲时也会回落
     size_t _maxSize = 1;
-    size_t _size = 0; //当前自由链表长度
+
+    size_t _lowWater = 0; // 上次周期回收以来栈的最低长度：这么多块整个周期都没被用到
+    size_t _underflows = 0; // 连续取空（向CC取块）的次数
+    size_t _overages = 0; // 连续溢出（向CC还块）的次数
 
 public:
     /**
-     * 弹出n个节点
-     * @param start 弹出的链表头
-     * @param end 弹出的链表尾
-     * @param n 弹出的长度为桶的maxSize
+     * 绑定指针数组
+     * @param slots 数组首地址
+     * @param capacity 数组容量
      */
-    void PopRange(void * &start, void * &end, size_t n)
+    void Init(void **slots, size_t capacity)
     {
-        assert(n<=_size);
-
-        // 1. 确定范围的起始点
-        start = end = _freeList;
-
-        // 2. 确定范围的结束点：end 向后移动 n-1 步
-        for (size_t i = 0; i < n - 1; ++i)
-        {
-            end = ObjNext(end);
-        }
+        _slots = slots;
+        _capacity = capacity;
+    }
 
-        // 3. 断开链表，更新 _freeList
-        // 让 _freeList 指向 end 的下一个节点（剩余链表的头）
-        _freeList = ObjNext(end);
+    /**
+     * 从栈顶弹出n个块
+     * @param n 弹出的数量
+     * @return 被弹出的这段指针数组，在下一次Push/PushRange之前有效
+     */
+    void **PopRange(size_t n)
+    {
+        assert(n <= _size);
         _size -= n;
+        if (_size < _lowWater)
+            _lowWater = _size;
+        return _slots + _size;
+    }
 
-        // 4. 封闭弹出的链表
-        // 将 end 的 next 指针置空，使其成为一个独立的链表片段
-        ObjNext(end) = nullptr;
+    /**
+     * 把n个块整段压入栈顶
+     * @param objs 块指针数组
+     * @param n 块数，不能超过剩余容量
+     */
+    void PushRange(void *const *objs, size_t n)
+    {
+        assert(n <= _capacity - _size);
+        memcpy(_slots + _size, objs, n * sizeof(void *));
+        _size += n;
     }
 
-    void PushRange(void *start, void *end, size_t actualNum)
+    // 栈顶之上的空闲位置：调用方（向CC取块时）直接把块写到这里，再用Commit入栈，省去一次拷贝
+    void **FreeSlots()
     {
-        // TC单次分配只分配桶中的一个块（Pop）
-        // 因此触发向CC申请内存时，一定是当前桶没块了
-        // 即_freeList = nullptr?
-        // assert(_freeList == nullptr);
+        return _slots + _size;
+    }
 
-        ObjNext(end) = _freeList;
-        _freeList = start;
-        _size += actualNum;
+    /**
+     * 把已经写进FreeSlots的n个块计入栈中
+     * @param n 块数，不能超过剩余容量
+     */
+    void Commit(size_t n)
+    {
+        assert(n <= _capacity - _size);
+        _size += n;
     }
 
     void Push(void *obj) //回收空间
     {
-        //头插
-        //在obj指向的内存中的“指针”写入_freeList
-        //将obj赋值给_freeList
-        ObjNext(obj) = _freeList;
-        _freeList = obj;
-        _size++;
+        assert(_size < _capacity);
+        _slots[_size++] = obj;
     }
 
     void *Pop() //分配空间，返回内存指针
     {
-        //头删
-        //将_freeList赋值为它指向的内存块中的指针
-        void *ptr = _freeList;
-        _freeList = ObjNext(ptr);
-        _size--;
-        return ptr;
+        assert(_size > 0);
+        void *obj = _slots[--_size];
+        if (_size < _lowWater)
+            _lowWater = _size;
+        return obj;
     }
 
     bool Empty() //判断哈希桶是否为空
     {
-        return _freeList == nullptr;
+        return _size == 0;
     }
 
     size_t &MaxSize() // 注意这里给引用，每次申请之后会让_maxSize++
@@ -175,18 +483,36 @@ public:
         return _maxSize;
     }
 
-    // DeBug：自由链表长度
     size_t Size()
     {
-        // size_t size = 0;
-        // void* cur = _freeList;
-        // while (cur)
-        // {
-        //     ++size;
-        //     cur = ObjNext(cur); // 移动到下一个节点
-        // }
         return _size;
     }
+
+    size_t LowWater()
+    {
+        return _lowWater;
+    }
+
+    // 开始新的统计周期
+    void ResetLowWater()
+    {
+        _lowWater = _size;
+    }
+
+    size_t &Underflows()
+    {
+        return _underflows;
+    }
+
+    size_t &Overages()
+    {
+        return _overages;
+    }
+
+    size_t Capacity()
+    {
+        return _capacity;
+    }
 };
 
 //笔记见MD
@@ -194,13 +520,14 @@ class SizeClass
 {
 public:
     // 计算每个分区对应的对齐后的字节数(大佬写法)
-    static size_t _RoundUp(size_t size, size_t alignNum)
+    static constexpr size_t _RoundUp(size_t size, size_t alignNum)
     {
         // alignNum是size对应分区的对齐数
         return ((size + alignNum - 1) & ~(alignNum - 1));
     }
 
-    static size_t RoundUp(size_t size) // 计算对齐后的字节数，size为线程申请的空间大小
+    // 分支版本的对齐计算。热路径上用查表的RoundUp，这里只用于编译期生成表和基准对比
+    static constexpr size_t ComputeRoundUp(size_t size) // 计算对齐后的字节数，size为线程申请的空间大小
     {
         if (size <= 128)
         {
@@ -231,21 +558,18 @@ public:
 
     // 计算映射的哪一个自由链表桶（tc和cc用，二者映射规则一样）
     // 求size对应在哈希表中的下标
-    static inline size_t _Index(size_t size, size_t align_shift)
+    static constexpr size_t _Index(size_t size, size_t align_shift)
     {
         /*这里align_shift是指对齐数的二进制位数。比如size为2的时候对齐数
             为8，8就是2^3，所以此时align_shift就是3*/
-        return ((size + (1 << align_shift) - 1) >> align_shift) - 1;
+        return ((size + ((size_t) 1 << align_shift) - 1) >> align_shift) - 1;
         //这里_Index计算的是当前size所在区域的第几个下标，所以Index的返回值需要加上前面所有区域的哈希桶的个数
     }
 
-    // 计算映射的哪一个自由链表桶
-    static inline size_t Index(size_t size)
+    // 分支版本的桶下标计算，同样只用于生成表和基准对比
+    static constexpr size_t ComputeIndex(size_t size)
     {
-        assert(size <= MAX_BYTES);
-
-        // 每个区间有多少个链
-        static int group_array[4] = {16, 56, 56, 56};
+        // 每个区间有多少个链：16, 56, 56, 56
         if (size <= 128)
         {
             // [1,128] 8B -->8B就是2^3B，对应二进制位为3位
@@ -253,34 +577,25 @@ public:
         } else if (size <= 1024)
         {
             // [128+1,1024] 16B -->4位
-            return _Index(size - 128, 4) + group_array[0];
+            return _Index(size - 128, 4) + 16;
         } else if (size <= 8 * 1024)
         {
             // [1024+1,8*1024] 128B -->7位
-            return _Index(size - 1024, 7) + group_array[1] + group_array[0];
+            return _Index(size - 1024, 7) + 16 + 56;
         } else if (size <= 64 * 1024)
         {
             // [8*1024+1,64*1024] 1024B -->10位
-            return _Index(size - 8 * 1024, 10) + group_array[2] + group_array[1]
-                   + group_array[0];
-        } else if (size <= 256 * 1024)
-        {
-            // [64*1024+1,256*1024] 8 * 1024B  -->13位
-            return _Index(size - 64 * 1024, 13) + group_array[3] +
-                   group_array[2] + group_array[1] + group_array[0];
+            return _Index(size - 8 * 1024, 10) + 16 + 56 + 56;
         } else
         {
-            assert(false);
-            return -1;
+            // [64*1024+1,256*1024] 8 * 1024B  -->13位
+            return _Index(size - 64 * 1024, 13) + 16 + 56 + 56 + 56;
         }
     }
 
     // 人为控制单次分配数量上限
-    static size_t NumMoveSize(size_t size)
+    static constexpr size_t NumMoveSize(size_t size)
     {
-        assert(size > 0);
-        int num = MAX_BYTES / size; //MAX_BYTES为TC单次申请上限
-
         /*TODO:如何理解？
         首先，MAX_BYTES=256KB。若TC申请8B，256KB/8B= 2^15,
         但显然这个数量太多了，若允许，TC会得到很多8b小块，
@@ -293,29 +608,103 @@ public:
         总结：[2,512]，是人为对分配上限的兜底
         小对象一次批量上限高；大对象一次批量上限低
         */
-        if (num > 512) num = 512;
-        if (num < 2) num = 2;
-
-        return num;
+        return MAX_BYTES / size > 512 ? 512 : (MAX_BYTES / size < 2 ? 2 : MAX_BYTES / size);
     }
 
     // 块页匹配
-    static size_t NumMovePage(size_t size)
+    static constexpr size_t NumMovePage(size_t size)
+    {
+        // 计算该块在CC中的单次分配上限的总字节数，右移实际上就是除以页大小
+        // 单次分配总字节数小于一页时计算出来为0，强制分配一页
+        return (NumMoveSize(size) * size) >> PAGE_SHIFT == 0 ? 1 : (NumMoveSize(size) * size) >> PAGE_SHIFT;
+    }
+
+private:
+    // 编译期生成的查找表：
+    // 1. <=1KB 按8B步长直接映射到桶下标
+    // 2. (1KB,256KB] 按128B步长映射（该区间最小对齐就是128B，同一格内一定属于同一个桶）
+    // 3. 桶下标 -> 块大小 / 单批数量 / 单次向PC申请的页数
+    // 热路径上的下标和对齐计算因此都只剩一两次访存
+    struct Table
     {
-        size_t n = NumMoveSize(size); // 计算该块在CC中的单次分配上限
-        size_t npage = n * size; // 计算单次分配上限的总字节数
+        uint8_t smallIndex[1024 / 8 + 1];
+        uint8_t largeIndex[MAX_BYTES / 128 + 1];
+        uint32_t classSize[FREE_LIST_NUM];
+        uint16_t classBatch[FREE_LIST_NUM];
+        uint16_t classPages[FREE_LIST_NUM];
+
+        constexpr Table()
+            : smallIndex(), largeIndex(), classSize(), classBatch(), classPages()
+        {
+            for (size_t i = 1; i <= 1024 / 8; ++i)
+            {
+                smallIndex[i] = (uint8_t) ComputeIndex(i << 3);
+            }
+            // size为0时按最小的块处理
+            smallIndex[0] = 0;
+            for (size_t i = 1024 / 128 + 1; i <= MAX_BYTES / 128; ++i)
+            {
+                largeIndex[i] = (uint8_t) ComputeIndex(i << 7);
+            }
+            for (size_t size = 8; size <= MAX_BYTES; size = ComputeRoundUp(size + 1))
+            {
+                size_t index = ComputeIndex(size);
+                classSize[index] = (uint32_t) size;
+                classBatch[index] = (uint16_t) NumMoveSize(size);
+                classPages[index] = (uint16_t) NumMovePage(size);
+            }
+        }
+    };
 
-        // 这里右移实际上就是除以页大小，即单次分配上限为多少页
-        npage >>= PAGE_SHIFT;
+    static const Table &GetTable()
+    {
+        static constexpr Table table;
+        return table;
+    }
 
-        // 这里主要考虑到单次分配总字节数小于一页的情况
-        // 此时计算出来的npage为0，强制分配一页
-        if (npage == 0)
+public:
+    // 计算对齐后的字节数，size为线程申请的空间大小
+    static inline size_t RoundUp(size_t size)
+    {
+        if (size <= MAX_BYTES)
+        {
+            return GetTable().classSize[Index(size)];
+        }
+        //单次申请大于256KB，直接按照页对齐
+        return _RoundUp(size, 1 << PAGE_SHIFT);
+    }
+
+    // 计算映射的哪一个自由链表桶
+    static inline size_t Index(size_t size)
+    {
+        assert(size <= MAX_BYTES);
+
+        if (size <= 1024)
         {
-            npage = 1;
+            return GetTable().smallIndex[(size + 7) >> 3];
         }
+        return GetTable().largeIndex[(size + 127) >> 7];
+    }
 
-        return npage;
+    // 由桶下标反算该桶的块大小，即Index的逆运算
+    static inline size_t Size(size_t index)
+    {
+        assert(index < FREE_LIST_NUM);
+        return GetTable().classSize[index];
+    }
+
+    // 桶的单批数量上限，等价于NumMoveSize(Size(index))
+    static inline size_t ClassBatch(size_t index)
+    {
+        assert(index < FREE_LIST_NUM);
+        return GetTable().classBatch[index];
+    }
+
+    // 桶单次向PC申请的页数，等价于NumMovePage(Size(index))
+    static inline size_t ClassPages(size_t index)
+    {
+        assert(index < FREE_LIST_NUM);
+        return GetTable().classPages[index];
     }
 };
 
@@ -328,12 +717,28 @@ struct Span
     // 用于判断span在PC还是在CC。只有当_isUse为True时，该span才算彻底脱离
     bool _isUse = false;
 
+    // 以下两个成员只在span位于PC的桶中时有意义
+    bool _isReturned = false; // 物理内存是否已经归还给操作系统（虚拟地址仍保留）
+    size_t _freeTime = 0; // 回到PC的时间（毫秒），用于判断空闲多久了
+
     // Span只有在CC中才会使用以下成员变量
+    // 大对象span直接交给用户时，_objSize记录申请的字节数，且保证 > MAX_BYTES，
+    // 释放时据此区分“切成小块的span”和“整个交给用户的span”
     size_t _objSize = 0; // span管理的页被切分的块大小
     Span *_next = nullptr; // 指向下一个span
     Span *_prev = nullptr; // 指向上一个span
     void *_freeList = nullptr; // span下挂载的内存块链表指针
     size_t _usecount = 0; //内存块使用计数， ==0 说明所有块都还回来了
+
+    // 最近一次从该span取走内存块的TC编号，只在CC的桶锁内读写。远程释放模式（MEMORYPOOL_REMOTE_FREE）下，
+    // 编号同时登记在页号映射每页的标记中，其它线程释放该span中的块时从那里不加锁读取，
+    // 把块推进这个TC的远程释放队列
+    uint32_t _ownerId = 0;
+
+    // 堆分析器（MEMORYPOOL_PROFILER）采样到的对象单独占用一个span，
+    // _sample指向它的调用栈记录，_sampleBytes为申请的字节数；释放时据此扣减
+    void *_sample = nullptr;
+    size_t _sampleBytes = 0;
 };
 
 class SpanList //Span为基础元素的双向链表
@@ -420,16 +825,22 @@ public:
     SpanList()
     {
         //构造哨兵位头节点
-        // TODO:替换为定长内存池，这里要不要换？
-        _head = new Span;
+        // 哨兵直接内嵌在SpanList里：不能用new（分配器可能接管了malloc），
+        // 而且ReleaseListToSpans每次都会构造局部SpanList，new出来的哨兵还会泄漏
+        _head = &_headNode;
         //哨兵节点指向自己？
         _head->_next = _head;
         _head->_prev = _head;
     }
 
+    SpanList(const SpanList &copy) = delete;
+
+    SpanList &operator =(const SpanList &copy) = delete;
+
 public:
     std::mutex mtx;
 
 private:
+    Span _headNode;
     Span *_head;
 };
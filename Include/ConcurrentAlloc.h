@@ -1,6 +1,17 @@
 #pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include"ThreadCache.h"
+#include "CentralCache.h"
 #include "PageCache.h"
+#include "Stats.h"
+#ifdef MEMORYPOOL_PER_CPU
+#include "CpuCache.h"
+#endif
+#ifdef MEMORYPOOL_PROFILER
+#include "HeapProfiler.h"
+#endif
 /**
  * 线程向TC申请内存
  * @param size 线程向TC申请的字节数
@@ -8,48 +19,479 @@
  */
 inline void *ConcurrentAlloc(size_t size)
 {
+#ifdef MEMORYPOOL_PROFILER
+    // 平均每PROFILE_SAMPLE_BYTES字节采样一次，热路径上只有一次线程局部的减法
+    if (HeapProfiler::ShouldSample(size))
+    {
+        return HeapProfiler::getInstance()->SampledAlloc(size);
+    }
+#endif
+
     // 单次申请大于256KB时，直接向PC申请
     if (size > MAX_BYTES)
     {
         size_t alignSize = SizeClass::RoundUp(size); // 按照页对齐
         size_t k = alignSize >> PAGE_SHIFT; // 计算需要多少页
-        void *ptr = nullptr;
+
+        // 超过128页的超大对象，PC的哈希桶管不了，走直通路径
+        if (k >= PAGE_NUM)
         {
-            std::unique_lock<std::mutex> pageLg(PageCache::getInstance()->_pageMtx);
-            Span *span = PageCache::getInstance()->NewSpan(k);
+            Span *span = PageCache::getInstance()->NewHugeSpan(k);
             span->_objSize = size;
-            ptr = (void *) (span->_pageId << PAGE_SHIFT); // 通过span计算首内存地址
+            return (void *) (span->_pageId << PAGE_SHIFT);
         }
-        return ptr;
+
+        // NewSpan返回时span已经被标记为使用中，不会被相邻span的释放合并走
+        Span *span = PageCache::getInstance()->NewSpan(k);
+        span->_objSize = size;
+        return (void *) (span->_pageId << PAGE_SHIFT); // 通过span计算首内存地址
     } else
     {
+#ifdef MEMORYPOOL_PER_CPU
+        return CpuCache::getInstance()->Allocate(size);
+#else
         return ThreadCache::getInstance()->Allocate(size);
+#endif
     }
 }
 
+/**
+ * 按对齐要求申请内存（align必须是2的幂）
+ * 1. align不超过一页：把size向上取整到align的倍数，对应桶的块大小一定是align的倍数，
+ *    而span首地址按页对齐、以块大小为步长切分，切出来的每一块天然按align对齐
+ * 2. align超过一页：直接从PC取首地址对齐的span，对齐前后多出的页会还回PC，不会浪费
+ * 按页对齐的span即使size很小也按大对象记录（_objSize > MAX_BYTES），
+ * 因此这类内存只能用不带大小的ConcurrentFree释放
+ * @param size 申请的字节数
+ * @param align 对齐字节数
+ * @return 返回指向内存的指针
+ */
+inline void *ConcurrentAllocAligned(size_t size, size_t align)
+{
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    if (align <= 8)
+    {
+        return ConcurrentAlloc(size);
+    }
+    if (size == 0)
+    {
+        size = align;
+    }
+    if (align <= (1 << PAGE_SHIFT))
+    {
+        return ConcurrentAlloc(SizeClass::_RoundUp(size, align));
+    }
+
+    size_t k = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+    size_t alignPages = align >> PAGE_SHIFT;
+    size_t objSize = size > MAX_BYTES ? size : MAX_BYTES + 1;
+
+    if (k >= PAGE_NUM)
+    {
+        Span *span = PageCache::getInstance()->NewHugeSpan(k, alignPages);
+        span->_objSize = objSize;
+        return (void *) (span->_pageId << PAGE_SHIFT);
+    }
+
+    Span *span = PageCache::getInstance()->NewAlignedSpan(k, alignPages);
+    span->_objSize = objSize;
+    return (void *) (span->_pageId << PAGE_SHIFT);
+}
+
+// 大对象（>256KB）和被采样对象的释放：超大对象的完整区域进入PC的大块空闲集合，其余还给PC的桶
+inline void ConcurrentFreeLarge(Span *span)
+{
+#ifdef MEMORYPOOL_PROFILER
+    if (span->_sample != nullptr)
+    {
+        HeapProfiler::getInstance()->RecordFree(span);
+    }
+#endif
+
+    if (span->_n >= PAGE_NUM)
+    {
+        // 超大对象的完整区域进入大块空闲集合（按回收策略再归还给操作系统），不完整的尾部按普通span归还
+        PageCache::getInstance()->ReleaseHugeSpan(span);
+        return;
+    }
+
+    // 超出256KB小于128页的span依然可以用这个函数释放
+    PageCache::getInstance()->ReleaseSpanToPageCache(span);
+}
+
 /**
  * 线程释放空间给TC
  * @param ptr 释放的空间的指针
- * @param size 释放的空间的大小
  * @return
  */
 inline void ConcurrentFree(void *ptr)
 {
     assert(ptr); //传入指针不得为空
 
+    // 小对象只查页号映射里每页一个字节的尺寸类，不访问span，少一次缓存缺失
+    size_t cls = PageCache::getInstance()->MapObjectToClass(ptr);
+    if (cls != 0)
+    {
+#ifdef MEMORYPOOL_PER_CPU
+        CpuCache::getInstance()->DeallocateByIndex(ptr, cls - 1);
+#else
+        ThreadCache::getInstance()->DeallocateByIndex(ptr, cls - 1);
+#endif
+        return;
+    }
+
+    // 大对象需要span去归还页
     Span *span = PageCache::getInstance()->MapObjectToSpan(ptr); // 获取ptr对应的span
-    size_t size = span->_objSize; // 获取块大小
+    assert(span->_objSize > MAX_BYTES || span->_sample != nullptr);
+    ConcurrentFreeLarge(span);
+}
+
+/**
+ * 计算size对应的桶下标，调用方可以提前算好并缓存，
+ * 之后用ConcurrentFreeSizeClass释放，连下标计算也省掉
+ * @param size 申请时的字节数（必须<=MAX_BYTES）
+ * @return 桶下标
+ */
+inline size_t ConcurrentSizeClass(size_t size)
+{
+    return SizeClass::Index(size);
+}
+
+/**
+ * 按桶下标释放小对象，完全不查基数树
+ * @param ptr 释放的空间的指针
+ * @param index ConcurrentSizeClass返回的桶下标
+ */
+inline void ConcurrentFreeSizeClass(void *ptr, size_t index)
+{
+    assert(ptr);
+    assert(index < FREE_LIST_NUM);
+
+#ifdef MEMORYPOOL_PROFILER
+    // 被采样的小对象单独占用一个span，不属于任何桶。它们一定在页首，
+    // 所以开启分析器后带大小的释放只对按页对齐的指针多查一次尺寸类
+    if (HeapProfiler::MaybeSampled(ptr) && PageCache::getInstance()->MapObjectToClass(ptr) == 0)
+    {
+        ConcurrentFree(ptr);
+        return;
+    }
+#endif
+
+#ifdef MEMORYPOOL_DEBUG_SIZED_FREE
+    Span *span = PageCache::getInstance()->MapObjectToSpan(ptr);
+    if (span->_objSize != SizeClass::Size(index))
+    {
+        fprintf(stderr, "ConcurrentFreeSizeClass: %p freed with size class %zu (%zu bytes), "
+                "but its span holds %zu-byte objects\n", ptr, index, SizeClass::Size(index), span->_objSize);
+        abort();
+    }
+#endif
+
+#ifdef MEMORYPOOL_PER_CPU
+    CpuCache::getInstance()->DeallocateByIndex(ptr, index);
+#else
+    ThreadCache::getInstance()->DeallocateByIndex(ptr, index);
+#endif
+}
+
+/**
+ * 带大小的释放（对应sized operator delete）：调用方已知道申请时的大小，
+ * 小对象直接按大小算出桶下标还给TC，不需要查基数树拿span->_objSize
+ * 定义MEMORYPOOL_DEBUG_SIZED_FREE后会用基数树校验传入的size与span是否一致
+ * @param ptr 释放的空间的指针
+ * @param size 申请时的字节数
+ */
+inline void ConcurrentFree(void *ptr, size_t size)
+{
+    assert(ptr);
 
     if (size > MAX_BYTES)
     {
+        // 大对象本来就要拿span去归还页，查一次基数树省不掉
+        Span *span = PageCache::getInstance()->MapObjectToSpan(ptr);
+#ifdef MEMORYPOOL_DEBUG_SIZED_FREE
+        if (SizeClass::RoundUp(span->_objSize) != SizeClass::RoundUp(size))
         {
-            // 加page锁
-            std::unique_lock<std::mutex> pageLg(PageCache::getInstance()->_pageMtx);
-            // 超出256KB小于128页的span依然可以用这个函数释放
-            PageCache::getInstance()->ReleaseSpanToPageCache(span);
+            fprintf(stderr, "ConcurrentFree: %p freed with size %zu, but was allocated with %zu bytes\n",
+                    ptr, size, span->_objSize);
+            abort();
         }
+#endif
+        ConcurrentFreeLarge(span);
     } else
     {
-        ThreadCache::getInstance()->Deallocate(ptr, size);
+        ConcurrentFreeSizeClass(ptr, SizeClass::Index(size));
+    }
+}
+
+/**
+ * 一次申请n个同样大小的内存块，适合一次要很多个同类小节点的场景
+ * 小对象的桶下标只算一次，本桶缓存的块整段取走，不够的部分向CC一次取回
+ * @param size 每块的字节数
+ * @param ptrs [out] 存放返回指针的数组，长度至少为n
+ * @param n 块数
+ */
+inline void ConcurrentAllocBatch(size_t size, void **ptrs, size_t n)
+{
+    if (size > MAX_BYTES)
+    {
+        // 大对象每个都要单独的span，批量没有可省的
+        for (size_t i = 0; i < n; ++i)
+        {
+            ptrs[i] = ConcurrentAlloc(size);
+        }
+        return;
     }
+
+#ifdef MEMORYPOOL_PROFILER
+    // 整批按总字节数计入倒计数，需要采样时只采第一个
+    if (n > 0 && HeapProfiler::ShouldSample(size * n))
+    {
+        ptrs[0] = HeapProfiler::getInstance()->SampledAlloc(size);
+        ++ptrs;
+        --n;
+    }
+#endif
+
+#ifdef MEMORYPOOL_PER_CPU
+    CpuCache::getInstance()->AllocateBatch(size, ptrs, n);
+#else
+    ThreadCache::getInstance()->AllocateBatch(size, ptrs, n);
+#endif
+}
+
+/**
+ * 一次释放n个同样大小的内存块（对应ConcurrentAllocBatch，也可以是逐个申请的）
+ * 小对象整批还给TC，不查span；远程释放模式下TC按页查一次所属的TC，别的TC的块分段推回给它
+ * @param ptrs 指针数组，不能包含nullptr
+ * @param n 块数
+ * @param size 申请时每块的字节数
+ */
+inline void ConcurrentFreeBatch(void **ptrs, size_t n, size_t size)
+{
+    if (size > MAX_BYTES)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            ConcurrentFree(ptrs[i], size);
+        }
+        return;
+    }
+
+    size_t index = SizeClass::Index(size);
+#ifdef MEMORYPOOL_PROFILER
+    // 其中有被采样的对象时逐个释放
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (HeapProfiler::MaybeSampled(ptrs[i]) && PageCache::getInstance()->MapObjectToClass(ptrs[i]) == 0)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                ConcurrentFreeSizeClass(ptrs[j], index);
+            }
+            return;
+        }
+    }
+#endif
+#ifdef MEMORYPOOL_DEBUG_SIZED_FREE
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t cls = PageCache::getInstance()->MapObjectToClass(ptrs[i]);
+        if (cls != index + 1)
+        {
+            fprintf(stderr, "ConcurrentFreeBatch: %p freed with size %zu, but its span holds %zu-byte objects\n",
+                    ptrs[i], size, PageCache::getInstance()->MapObjectToSpan(ptrs[i])->_objSize);
+            abort();
+        }
+    }
+#endif
+
+#ifdef MEMORYPOOL_PER_CPU
+    CpuCache::getInstance()->DeallocateBatch(ptrs, n, index);
+#else
+    ThreadCache::getInstance()->DeallocateBatch(ptrs, n, index);
+#endif
+}
+
+/**
+ * 查询ptr实际可用的字节数（>=申请时的大小）
+ * 小对象为所在桶的块大小；大对象为span管理的全部页
+ * @param ptr ConcurrentAlloc返回的指针
+ * @return 可用字节数
+ */
+inline size_t ConcurrentUsableSize(void *ptr)
+{
+    assert(ptr);
+
+    Span *span = PageCache::getInstance()->MapObjectToSpan(ptr);
+    if (span->_objSize > MAX_BYTES)
+    {
+        return span->_n << PAGE_SHIFT;
+    }
+    return span->_objSize;
+}
+
+/**
+ * ptr是否由本分配器申请（落在PC管理的页上）
+ * 开启MEMORYPOOL_ARENA时只是一次区间比较，可以放在每次释放的路径上
+ * @param ptr 任意指针
+ * @return 是本分配器的内存时返回true
+ */
+inline bool ConcurrentIsOwned(const void *ptr)
+{
+    return PageCache::getInstance()->IsOwned(ptr);
+}
+
+/**
+ * 把调用线程的TC中缓存的块全部还给CC，变空的span还给PC
+ * 线程池的线程在空闲（park）前调用，避免长期不用的线程一直占着缓存；TC本身保留，之后照常使用
+ * 每CPU缓存模式下清空当前CPU的槽位
+ * @return 交出的字节数
+ */
+inline size_t ConcurrentFlushThreadCache()
+{
+#ifdef MEMORYPOOL_PER_CPU
+    return CpuCache::getInstance()->Flush(false);
+#else
+    return ThreadCache::getInstance()->Flush();
+#endif
+}
+
+/**
+ * 尽可能把空闲内存还出去：清空调用线程的TC（每CPU缓存模式下清空所有槽位）和CC的传输缓存，
+ * 变空的span全部回到PC，再按需把PC中所有空闲span（大块空闲集合和各个桶中的）的物理内存还给操作系统
+ * 其它线程TC中的缓存不受影响，需要各自调用ConcurrentFlushThreadCache
+ * @param releaseToOS 为true时调用PC的ReleaseFreeMemory归还物理内存
+ * @return 归还给操作系统的字节数
+ */
+inline size_t ConcurrentReleaseFreeMemory(bool releaseToOS = true)
+{
+#ifdef MEMORYPOOL_PER_CPU
+    CpuCache::getInstance()->Flush(true);
+#else
+    ThreadCache::getInstance()->Flush();
+#endif
+    CentralCache::getInstance()->ReleaseTransferCaches();
+
+    if (!releaseToOS)
+        return 0;
+    return PageCache::getInstance()->ReleaseFreeMemory() << PAGE_SHIFT;
+}
+
+/**
+ * 分配器的统计快照：按桶的申请/释放/取块次数，各层空闲的字节数，申请/常驻/使用中的字节数
+ * 各层的计数平时各自维护，这里才汇总，不会停下其它线程
+ * @return 统计快照
+ */
+inline MemoryPoolStats ConcurrentGetStats()
+{
+    MemoryPoolStats stats;
+    CollectStats(stats);
+    return stats;
+}
+
+/**
+ * 以JSON格式返回统计快照，便于导出到监控系统
+ * @return JSON字符串
+ */
+inline std::string ConcurrentStatsJson()
+{
+    return StatsToJson(ConcurrentGetStats());
+}
+
+#ifdef MEMORYPOOL_PROFILER
+/**
+ * 设置堆分析器的平均采样间隔
+ * @param bytes 平均每申请多少字节采样一次，为0时停止采样
+ */
+inline void ConcurrentSetProfileSampleRate(size_t bytes)
+{
+    HeapProfiler::getInstance()->SetSampleRate(bytes);
+}
+
+/**
+ * 以pprof格式输出当前仍在使用的内存的采样（按调用栈汇总），可用 pprof -inuse_space 查看
+ * @param path 输出文件路径
+ * @return 写入成功时返回true
+ */
+inline bool ConcurrentDumpHeapProfile(const char *path)
+{
+    return HeapProfiler::getInstance()->DumpHeapProfile(path);
+}
+
+/**
+ * 以pprof格式输出启动以来所有采样过的申请（包括已释放的），可用 pprof -alloc_space 查看
+ * @param path 输出文件路径
+ * @return 写入成功时返回true
+ */
+inline bool ConcurrentDumpAllocationProfile(const char *path)
+{
+    return HeapProfiler::getInstance()->DumpAllocationProfile(path);
+}
+#endif
+
+/**
+ * 调整ptr指向内存的大小，尽量原地完成，避免整块拷贝
+ * 1. 小对象：新大小仍落在原来的桶（块大小相同）时直接返回原指针
+ * 2. 大对象：新大小放得下span现有的页时直接返回原指针，缩到一半以下时把多出的页还给PC；
+ *    否则尝试把右邻的空闲span并过来（超大对象则尝试原地延长映射）
+ * 3. 以上都不行才重新申请、拷贝并释放旧内存
+ * @param ptr ConcurrentAlloc返回的指针，为nullptr时等价于ConcurrentAlloc(size)
+ * @param size 新的字节数，为0时释放ptr并返回nullptr
+ * @return 调整后的指针
+ */
+inline void *ConcurrentRealloc(void *ptr, size_t size)
+{
+    if (ptr == nullptr)
+    {
+        return ConcurrentAlloc(size);
+    }
+    if (size == 0)
+    {
+        ConcurrentFree(ptr);
+        return nullptr;
+    }
+
+    Span *span = PageCache::getInstance()->MapObjectToSpan(ptr);
+    size_t oldSize = span->_objSize;
+
+    if (oldSize <= MAX_BYTES)
+    {
+        if (size <= MAX_BYTES && SizeClass::RoundUp(size) == oldSize)
+        {
+            return ptr;
+        }
+    } else if (size > MAX_BYTES)
+    {
+        size_t k = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+        bool fit = k <= span->_n;
+        if (fit && k <= span->_n / 2)
+        {
+            // 缩到一半以下：把多出的页还给PC，否则整块一直占着原来的页
+            PageCache::getInstance()->ShrinkSpan(span, k);
+        }
+
+        if (!fit && span->_n >= PAGE_NUM)
+        {
+            fit = PageCache::getInstance()->TryGrowHugeSpan(span, k);
+        } else if (!fit && k < PAGE_NUM)
+        {
+            fit = PageCache::getInstance()->TryGrowSpan(span, k);
+        }
+
+        if (fit)
+        {
+            span->_objSize = size;
+            return ptr;
+        }
+    }
+
+    // 原地放不下，重新申请并拷贝。旧内存的可用大小按span计算，
+    // 而不是按_objSize，后者对按页对齐的小对象只是一个大对象标记
+    void *newPtr = ConcurrentAlloc(size);
+    size_t oldUsable = ConcurrentUsableSize(ptr);
+    memcpy(newPtr, ptr, oldUsable < size ? oldUsable : size);
+    ConcurrentFree(ptr);
+    return newPtr;
 }
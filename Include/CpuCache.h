@@ -0,0 +1,110 @@
+#pragma once
+#include "Common.h"
+#include "ThreadCache.h"
+
+/**
+ * 每CPU缓存：ThreadCache的替代前端（编译时定义 MEMORYPOOL_PER_CPU 启用）
+ *
+ * thread_local 的TC按线程数量扩展，线程很多而核数较少时，大量内存滞留在空闲线程里。
+ * 这里改为每个CPU一份缓存，内存占用随核数而不是线程数增长。
+ *
+ * 分两层：
+ * 1. 快路径：每个CPU每个桶一个指针数组栈，用rseq（restartable sequences）临界区弹出/压入，
+ *    不加锁也没有原子读改写。临界区内读当前CPU号、算出数组地址，最后一条指令写回栈的长度提交；
+ *    提交前线程被抢占或迁移，内核会让它跳到abort处从头再来，因此同一CPU上的操作天然互斥。
+ *    目前只在x86-64上实现，要求glibc（2.35+）为线程注册了rseq
+ * 2. 慢路径：每个CPU一个槽位，内部直接复用ThreadCache的分配/回收逻辑，由自旋锁保护。
+ *    槽位也取空时解锁后再向CC取块，锁内不会等CC/PC的锁或系统调用；
+ *    快路径的数组取空时从槽位批量补充，压满时把一半连同这个块还给槽位。
+ *    数组中的块计入槽位的预算，补充/归还时检查，超出预算或空闲时倒回槽位。
+ *    读到CPU号之后线程仍可能被迁移到别的核，只会造成偶尔的跨核竞争，不会影响正确性
+ * 不支持rseq时（其它架构、内核或glibc不支持）只用慢路径，CPU号退回sched_getcpu。
+ */
+class CpuCache
+{
+public:
+    // 单例。槽位数组在第一次使用时按CPU数量向系统申请，进程生命周期内不释放
+    static CpuCache *getInstance()
+    {
+        static CpuCache _sInst;
+        return &_sInst;
+    }
+
+    CpuCache(const CpuCache &copy) = delete;
+
+    CpuCache &operator =(const CpuCache &copy) = delete;
+
+    // 从当前CPU的缓存分配内存
+    void *Allocate(size_t size);
+
+    // 把内存还给当前CPU的缓存
+    void Deallocate(void *obj, size_t size);
+
+    // 按桶下标还给当前CPU的缓存
+    void DeallocateByIndex(void *obj, size_t index);
+
+    // 从当前CPU的缓存一次申请n个同样大小的块
+    void AllocateBatch(size_t size, void **ptrs, size_t n);
+
+    // 把n个同一桶的块一次还给当前CPU的缓存
+    void DeallocateBatch(void **ptrs, size_t n, size_t index);
+
+    /**
+     * 把缓存的块全部还给CC
+     * 快路径的栈只能在所在的CPU上操作：清空所有槽位时，调用线程会依次绑定到每个CPU上去倒空它的栈，
+     * 结束后恢复原来的CPU亲和性；不允许运行的CPU上的栈保持原样
+     * @param all 为false时只清空当前CPU的栈和槽位，为true时逐个清空所有CPU
+     * @return 交出的字节数
+     */
+    size_t Flush(bool all);
+
+    // 当前线程所在的CPU号（已对槽位数取模）
+    size_t CurrentCpu();
+
+    /**
+     * 把快路径数组中的块数累加到统计中（计入threadCacheBytes），不加锁，读到的是近似值
+     * @param stats [in/out] 累加到这里
+     */
+    void CollectStats(MemoryPoolStats &stats);
+
+private:
+    CpuCache();
+
+    // 快路径数组取空：从当前CPU的槽位取一批，返回其中一个，其余压入数组
+    void *Refill(size_t index);
+
+    // 快路径数组压满：弹出一半连同obj一起还给当前CPU的槽位
+    void Spill(void *obj, size_t index);
+
+    // 把当前所在CPU的快路径数组全部还给槽位，返回交出的字节数
+    size_t DrainCurrentCpu();
+
+    // 槽位按缓存行对齐，避免相邻CPU的锁产生伪共享
+    struct alignas(64) Slot
+    {
+        SpinLock lock;
+        ThreadCache cache;
+        std::atomic<size_t> slowOps{0}; // 快路径在这个CPU上补充/归还的次数，可能漏计，只用来决定何时检查
+    };
+
+    /**
+     * 在Refill/Spill之后（不持有槽位的锁），每CPU_CACHE_CHECK_INTERVAL次检查一次当前CPU的快路径数组：
+     * 数组中的字节数记在槽位的预算上，合计超出且扩不了预算时，把数组倒回槽位，由槽位收缩到预算以内；
+     * 每隔THREAD_CACHE_RELEASE_MS也倒回一次，再由槽位按低水位把空闲的块还给CC
+     * @param slot 当前CPU的槽位
+     */
+    void Maintain(Slot &slot);
+
+    Slot *_slots = nullptr;
+    size_t _numCpus = 1;
+
+    // 快路径数组：每个CPU占_fastStride字节，开头是各桶栈的长度（size_t[FREE_LIST_NUM]），
+    // 之后是各桶的指针数组，第i个桶在_fastOffset[i]处，容量为_fastCapacity[i]（一批，不超过CPU_CACHE_FAST_BYTES；
+    // 为0的桶不走快路径）
+    // 只预留地址空间，物理页在用到时才分配
+    char *_fast = nullptr;
+    size_t _fastStride = 0;
+    size_t _fastOffset[FREE_LIST_NUM] = {};
+    size_t _fastCapacity[FREE_LIST_NUM] = {};
+    bool _useRseq = false; // 本进程是否可以走快路径
+};
@@ -0,0 +1,156 @@
+#pragma once
+#include <new>
+#include "Common.h"
+#include "ObjectPool.h"
+
+/**
+ * 采样式堆分析器（编译时定义 MEMORYPOOL_PROFILER 启用）
+ *
+ * 每个线程维护一个字节倒计数，每次申请减去申请的字节数，减到负数时采样这次申请。
+ * 倒计数按均值为采样间隔的指数分布随机选取，平均每申请采样间隔字节采样一次，
+ * 热路径上只多一次线程局部变量的减法和比较。
+ *
+ * 被采样的对象（小对象也一样）单独占用一个span，span->_sample指向它调用栈的汇总记录，
+ * 释放时看到span上的标记就能扣减，不需要另外的查找表。
+ * 小对象因此不再属于任何桶（页的尺寸类为0）。被采样的对象都在页首，
+ * 带大小的释放和批量释放只对按页对齐的指针查一次尺寸类。
+ *
+ * 按调用栈汇总后，以pprof能直接读取的旧版文本格式（heap_v2）输出：
+ * 每个调用栈一行 “使用中块数: 使用中字节数 [累计块数: 累计字节数] @ 地址...”，
+ * 文件末尾附上/proc/self/maps，pprof据此符号化并按采样间隔还原真实的数量
+ */
+class HeapProfiler
+{
+public:
+    // 单例，构造在静态存储上，进程退出时不析构
+    static HeapProfiler *getInstance()
+    {
+        alignas(HeapProfiler) static char _sStorage[sizeof(HeapProfiler)];
+        static HeapProfiler *_sInst = new(_sStorage) HeapProfiler;
+        return _sInst;
+    }
+
+    HeapProfiler(const HeapProfiler &copy) = delete;
+
+    HeapProfiler &operator =(const HeapProfiler &copy) = delete;
+
+    /**
+     * 热路径：本次申请是否需要采样
+     * @param size 申请的字节数
+     * @return 需要采样时返回true，调用方改为调用SampledAlloc
+     */
+    static bool ShouldSample(size_t size)
+    {
+        int64_t &countdown = Countdown();
+        countdown -= (int64_t) size;
+        if (countdown >= 0)
+        {
+            return false;
+        }
+        return PickNextSample();
+    }
+
+    // 被采样的对象都在span的首页页首，不按页对齐的指针一定不是
+    static bool MaybeSampled(const void *ptr)
+    {
+        return ((uintptr_t) ptr & ((1 << PAGE_SHIFT) - 1)) == 0;
+    }
+
+    /**
+     * 为被采样的申请单独分配一个span，并记录调用栈
+     * @param size 申请的字节数
+     * @return 内存块指针
+     */
+    void *SampledAlloc(size_t size);
+
+    /**
+     * 释放被采样对象所在的span前调用：扣减调用栈记录中的使用量，并清除span上的标记
+     * @param span 带_sample标记的span
+     */
+    void RecordFree(Span *span);
+
+    /**
+     * 设置平均采样间隔
+     * @param bytes 平均每申请多少字节采样一次，为0时停止采样。
+     *              已有的倒计数不会立即重置，新间隔在各线程下一次采样（或停止采样后的复查）时生效
+     */
+    void SetSampleRate(size_t bytes)
+    {
+        _sampleRate.store(bytes, std::memory_order_relaxed);
+    }
+
+    size_t SampleRate() const
+    {
+        return _sampleRate.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * 输出当前仍在使用的对象的采样（按调用栈汇总）
+     * @param path 输出文件路径
+     * @return 文件打开或写入失败时返回false
+     */
+    bool DumpHeapProfile(const char *path)
+    {
+        return WriteProfile(path, true);
+    }
+
+    /**
+     * 输出启动以来所有采样过的申请（包括已经释放的），方括号中的累计值即为申请量
+     * @param path 输出文件路径
+     * @return 文件打开或写入失败时返回false
+     */
+    bool DumpAllocationProfile(const char *path)
+    {
+        return WriteProfile(path, false);
+    }
+
+private:
+    HeapProfiler() = default;
+
+    // 一个调用栈的汇总记录，同一个调用栈的所有采样共用
+    struct StackEntry
+    {
+        size_t hash = 0;
+        size_t depth = 0;
+        void *pcs[PROFILE_MAX_DEPTH];
+        size_t liveObjs = 0; // 仍在使用的采样数
+        size_t liveBytes = 0;
+        size_t allocObjs = 0; // 累计的采样数
+        size_t allocBytes = 0;
+        StackEntry *next = nullptr; // 哈希桶中的下一个
+    };
+
+    // 每个线程的采样状态
+    struct ThreadState
+    {
+        uint64_t rng = 0; // xorshift随机数状态，0表示本线程还没开始计数
+        bool busy = false; // 正在采样（抓调用栈时可能再次申请内存），此时不再采样
+    };
+
+    static int64_t &Countdown()
+    {
+        static thread_local int64_t countdown MEMORYPOOL_TLS_MODEL = 0;
+        return countdown;
+    }
+
+    static ThreadState &State()
+    {
+        static thread_local ThreadState state MEMORYPOOL_TLS_MODEL;
+        return state;
+    }
+
+    // 倒计数用完时调用：重新选取倒计数，并判断这次是否真的采样（第一次计数、正在采样时不算）
+    static bool PickNextSample();
+
+    // 查找或插入调用栈记录，调用时持有_mtx
+    StackEntry *FindOrInsert(void *const *pcs, size_t depth);
+
+    bool WriteProfile(const char *path, bool liveOnly);
+
+    static const size_t HASH_SIZE = 4096;
+
+    std::mutex _mtx; // 保护哈希表和记录中的计数。只在采样、释放被采样对象和输出时加锁
+    StackEntry *_table[HASH_SIZE] = {};
+    ObjectPool<StackEntry> _entryPool;
+    std::atomic<size_t> _sampleRate{PROFILE_SAMPLE_BYTES};
+};
@@ -3,7 +3,7 @@
 
 #pragma once
 #include "Common.h"
-#include <vector>
+#include <new>
 
 // 定义单次向系统申请的页数 (16页 * 8KB = 128KB)
 template<typename T, size_t ALLOC_PAGES = 16>
@@ -11,7 +11,9 @@ class ObjectPool
 {
 private:
     char *_memory = nullptr; //指向当前可用的内存池的指针
-    std::vector<char *> _M; //存放所有申请的内存池
+    // 所有申请的内存池串成单链表，链接指针放在每块内存池的最后8字节。
+    // 不能用std::vector记录：vector扩容会调用malloc，而本项目的分配器本身就可能接管malloc
+    char *_chunks = nullptr;
     size_t _remanenetBytes = 0; //内存池剩余量
     void *_freelist = nullptr; //自由链表的头指针
 
@@ -36,10 +38,11 @@ public:
             if (_remanenetBytes < objSize) //判定空间是否足够
             {
                 // 彻底替换 malloc 为底层的 SystemAlloc
-                // 16页 * 8192字节 = 131072字节 (128KB)
-                _remanenetBytes = ALLOC_PAGES << PAGE_SHIFT;
+                // 16页 * 8192字节 = 131072字节 (128KB)，最后8字节留给链接指针
+                _remanenetBytes = (ALLOC_PAGES << PAGE_SHIFT) - sizeof(char *);
                 _memory = (char *) SystemAlloc(ALLOC_PAGES);
-                _M.push_back(_memory);
+                *(char **) (_memory + _remanenetBytes) = _chunks;
+                _chunks = _memory;
 
                 // 注意：由于 SystemAlloc 内部如果申请失败已经执行了 throw std::bad_alloc();
                 // 所以这里不再需要像之前 malloc 那样手动判断 _memory == nullptr
@@ -72,9 +75,74 @@ public:
     {
         // 彻底替换 free 为底层的 SystemFree
         // 注意 SystemFree 需要传入分配时的页数
-        for (char *ptr: _M)
+        const size_t linkOffset = (ALLOC_PAGES << PAGE_SHIFT) - sizeof(char *);
+        while (_chunks)
         {
-            SystemFree(ptr, ALLOC_PAGES);
+            char *next = *(char **) (_chunks + linkOffset);
+            SystemFree(_chunks, ALLOC_PAGES);
+            _chunks = next;
         }
     }
 };
+
+
+/**
+ * STL容器的分配器：节点内存来自ObjectPool而不是malloc
+ * 本项目的分配器可能接管了malloc，PC内部的容器不能反过来调用malloc
+ * 每种节点类型共用一个静态的ObjectPool，不加锁，使用者需自行保证互斥；
+ * 只支持一次分配一个对象，适用于std::set/std::map这类节点式容器
+ */
+template<typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        assert(n == 1);
+        (void) n;
+        return (T *) Pool().New();
+    }
+
+    void deallocate(T *ptr, size_t n)
+    {
+        assert(n == 1);
+        (void) n;
+        Pool().Delete((Slot *) ptr);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &) const
+    {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U> &) const
+    {
+        return false;
+    }
+
+private:
+    // 只提供大小和对齐合适的原始内存，构造由容器负责
+    struct Slot
+    {
+        alignas(T) char data[sizeof(T)];
+    };
+
+    // 与各单例一样构造在静态存储上，进程退出时不析构，避免退出阶段的释放访问到已销毁的池
+    static ObjectPool<Slot> &Pool()
+    {
+        alignas(ObjectPool<Slot>) static char _sStorage[sizeof(ObjectPool<Slot>)];
+        static ObjectPool<Slot> *_sPool = new(_sStorage) ObjectPool<Slot>;
+        return *_sPool;
+    }
+};
@@ -4,31 +4,69 @@
 
 #pragma once
 #include "Common.h"
+#include <chrono>
+#include <map>
+#include <set>
 #include <unordered_map>
 #include "ObjectPool.h"
-#include "TCMalloc_PageMap3.h"
+#include "PageMap.h"
+#include "Arena.h"
 
+/**
+ * PC的加锁方式：
+ * 1. 向系统申请的内存以128页（1MB）为一块，且首地址按1MB对齐，称为一个区域（region）。
+ *    PC中的span永远不跨区域：切分只会变小，合并只在区域内进行
+ * 2. 合并/切分/原地扩展只涉及同一区域内的相邻span，由该区域的锁保护（按区域号取模的分段锁），
+ *    不同区域的span归还、切分互不阻塞
+ * 3. 每个桶有自己的锁（SpanList::mtx），只保护链表本身和非空桶位图中对应的位
+ * 4. 整个区域都空闲时，span离开桶，进入按大小和按地址排序的大块空闲集合（_largeMtx保护）。
+ *    集合中的span都由完整的区域组成，相邻的会不限大小地合并；
+ *    区域不够用或超大对象（>128页）都先从这里按最佳适配切，切不出来才向系统申请
+ * 加锁顺序固定为 区域锁 -> 桶锁 / 区域锁 -> _largeMtx；
+ * NewSpan从桶里挑span时反过来只用try_lock，不会死锁
+ * SystemAlloc在任何锁之外调用
+ */
 class PageCache
 {
 public:
-    std::mutex _pageMtx;
-
-    // 单例模式
+    // 单例模式，与CC一样构造在静态存储上，进程退出时不析构
     static PageCache *getInstance()
     {
-        static PageCache _sInst;
-        return &_sInst;
+        alignas(PageCache) static char _sStorage[sizeof(PageCache)];
+        static PageCache *_sInst = new(_sStorage) PageCache;
+        return _sInst;
     }
 
 
     /**
      * 从PC的第K个桶弹出一个控制K页空间的span
      * 在这个过程中还要对Span的页号和地址进行映射
+     * 返回的span已标记为使用中，调用方不需要加锁
      * @param k 弹出的span控制的空间页数
      * @return span指针
      */
     Span *NewSpan(size_t k);
 
+    /**
+     * 基准测试用：与NewSpan相同，但像引入非空桶位图之前那样从k开始逐个桶检查是否为空，
+     * 用于在同一个页堆上对比两种查找方式的开销
+     * @param k 弹出的span控制的空间页数
+     * @return span指针
+     */
+    Span *NewSpanLinearScan(size_t k);
+
+    /**
+     * 弹出一个首地址按alignPages页对齐的k页span
+     * 先按k+alignPages-1页取一个span，再把对齐点之前和k页之后多出来的部分
+     * 切成独立的span还回PC，不会额外浪费内存；
+     * 多出来的页数放不进PC的桶时，改为单独取一个按对齐要求的区域
+     * 返回的span已标记为使用中
+     * @param k 页数（< PAGE_NUM）
+     * @param alignPages 对齐的页数（2的幂）
+     * @return span指针
+     */
+    Span *NewAlignedSpan(size_t k, size_t alignPages);
+
     /**
      * 内存地址到span的映射
      * @param obj 内存块指针
@@ -36,38 +74,395 @@ public:
      */
     Span *MapObjectToSpan(void *obj);
 
-    // 管理CC释放的span，合并span前后空间
-    // 整个过程需要加锁，因为Span的状态不能发生变化
+    /**
+     * 内存地址到尺寸类的映射：只读页号映射中每页一个字节的尺寸类数组，不访问Span
+     * @param obj 内存块指针
+     * @return 小对象所在桶的下标 + 1；大对象返回0，需要再用MapObjectToSpan取span
+     */
+    size_t MapObjectToClass(void *obj)
+    {
+        return _idSpanMap.getClass((size_t) obj >> PAGE_SHIFT);
+    }
+
+    /**
+     * CC把span切成小对象之前，为span的每一页登记尺寸类
+     * span回到PC后重新分配出去时，页号映射的set会把登记清零
+     * @param span CC刚取到的span
+     * @param index 桶下标
+     */
+    void SetSpanClass(Span *span, size_t index)
+    {
+        static_assert(FREE_LIST_NUM < 255, "size class must fit in one byte");
+        for (size_t i = 0; i < span->_n; ++i)
+        {
+            _idSpanMap.setClass(span->_pageId + i, index + 1);
+        }
+        span->_ownerId = 0; // setClass同时清掉了页上登记的TC编号
+    }
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    /**
+     * 读取块所在页登记的TC编号，与尺寸类在同一个标记里，不访问Span
+     * @param obj 小对象指针
+     * @return 最近从块所在span取块的TC编号，0表示没有登记
+     */
+    uint32_t MapObjectToOwner(void *obj)
+    {
+        return _idSpanMap.getOwner((size_t) obj >> PAGE_SHIFT);
+    }
+
+    /**
+     * CC把span中的块交给编号为owner的TC时，为span的每一页登记这个编号，调用时持有CC的桶锁
+     * @param span 切成小对象的span
+     * @param owner TC编号
+     */
+    void SetSpanOwner(Span *span, uint32_t owner)
+    {
+        static_assert(REMOTE_OWNER_NUM <= ((size_t) 1 << (sizeof(PageTag) * 8 - PAGE_TAG_CLASS_BITS)),
+                      "owner id must fit in the page tag");
+        for (size_t i = 0; i < span->_n; ++i)
+        {
+            _idSpanMap.setOwner(span->_pageId + i, owner);
+        }
+    }
+#endif
+
+    /**
+     * ptr是否是本分配器管理的内存
+     * 地址空间预留模式下只需一次区间比较，否则查一次基数树
+     * @param ptr 任意指针
+     * @return 落在PC管理的页上时返回true
+     */
+    bool IsOwned(const void *ptr)
+    {
+#ifdef MEMORYPOOL_ARENA
+        return _arena.IsOwned(ptr);
+#else
+        return _idSpanMap.get((size_t) ptr >> PAGE_SHIFT) != nullptr;
+#endif
+    }
+
+    /**
+     * 原地扩展一个使用中的span：右邻的span空闲、页数足够且在同一区域内时，
+     * 把需要的页并过来，剩余部分仍留在PC中
+     * @param span 使用中的span（页数 < PAGE_NUM）
+     * @param k 扩展后的总页数（< PAGE_NUM）
+     * @return 扩展成功返回true，span->_n变为k
+     */
+    bool TryGrowSpan(Span *span, size_t k);
+
+    // 管理CC释放的span，在所属区域内合并span前后空间
+    // 只持有该区域的锁，因为合并只会动到同一区域内的相邻span
+    // 合并出完整的区域时，转入大块空闲集合
     void ReleaseSpanToPageCache(Span *span);
 
+    /**
+     * 把大块空闲集合中span的物理内存还给操作系统（虚拟地址仍保留在集合中）
+     * 满足任一条件的span会被归还：空闲时间超过_releaseIdleMs，
+     * 或集合中仍占用物理内存的字节数超过_retainedLimit（归还到不超限为止）
+     * 归还后相邻的已归还span会合并成一个。madvise在_largeMtx之外进行
+     * @param force 为true时忽略空闲时间，归还所有大块空闲span
+     * @param keepPageId 不归还首页为此页号的span（刚放进集合的span），0表示没有
+     * @return 本次归还的页数
+     */
+    size_t ReleaseIdleSpans(bool force = false, size_t keepPageId = 0);
+
+    /**
+     * 把桶中仍占用物理内存的空闲span还给操作系统，span标记为已归还后挂回原来的桶。
+     * 桶中的span很快会被再次切分使用，只在显式回收时才调用
+     * @return 本次归还的页数
+     */
+    size_t ReleaseBucketSpans();
+
+    // 按需回收：归还所有大块空闲span和桶中的空闲span，供上层在空闲时主动释放内存
+    size_t ReleaseFreeMemory()
+    {
+        return ReleaseIdleSpans(true) + ReleaseBucketSpans();
+    }
+
+    /**
+     * 配置回收策略
+     * @param idleMs span在PC中空闲超过该毫秒数后归还给操作系统
+     * @param retainedBytes 大块空闲集合最多保留多少字节仍占用物理内存的空闲页，超出部分立即归还
+     *                      （桶中的span只在ReleaseFreeMemory时回收，不计入）
+     */
+    void SetReleaseConfig(size_t idleMs, size_t retainedBytes)
+    {
+        _releaseIdleMs = idleMs;
+        _retainedLimit = retainedBytes;
+    }
+
+    /**
+     * 配置向系统申请内存的策略
+     * 每次向系统申请时，从minBytes开始按倍数增长到maxBytes，减少mmap次数和内核中的映射区数量；
+     * 多申请的部分不会被访问，也就不占物理内存
+     * @param minBytes 第一次申请的字节数
+     * @param maxBytes 单次申请的字节数上限，与minBytes相同时即为固定大小
+     * @param hugePages 为true时按2MB对齐申请，并建议内核用透明大页支撑
+     */
+    void SetGrowthConfig(size_t minBytes, size_t maxBytes, bool hugePages)
+    {
+        // 按区域取整，至少一个区域
+        size_t minPages = ((minBytes >> PAGE_SHIFT) + REGION_PAGES - 1) / REGION_PAGES * REGION_PAGES;
+        if (minPages == 0)
+            minPages = REGION_PAGES;
+        size_t maxPages = maxBytes >> PAGE_SHIFT;
+        _growMaxPages = maxPages > minPages ? maxPages : minPages;
+        _growPages = minPages;
+        _hugePages = hugePages;
+    }
+
+    /**
+     * 预先开辟一段地址在页号映射中的全部结构（中间节点和叶子）
+     * PC每次向系统申请时都会为整段内存做这件事；已知堆会落在哪段地址时
+     * （例如自己预留了地址空间），可以提前调用，让这段范围内的查找从一开始就完全无锁
+     * @param start 起始地址
+     * @param bytes 字节数
+     */
+    void PrepopulatePageMap(const void *start, size_t bytes)
+    {
+        size_t first = (size_t) start >> PAGE_SHIFT;
+        size_t last = ((size_t) start + bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        _idSpanMap.Ensure(first, last - first);
+    }
+
+    // PC中空闲且仍占用物理内存的字节数
+    size_t FreeBytes() const
+    {
+        return _freePages << PAGE_SHIFT;
+    }
+
+    // PC中已经归还给操作系统的字节数
+    size_t ReturnedBytes() const
+    {
+        return _returnedPages << PAGE_SHIFT;
+    }
+
+    // PC向系统申请的全部字节数（地址空间预留模式下为已提交的部分）
+    size_t MappedBytes() const
+    {
+        return _mappedPages << PAGE_SHIFT;
+    }
+
+    /**
+     * 超大对象（k >= PAGE_NUM，即超过128页/1MB）：占用若干个完整的区域，
+     * 优先从大块空闲集合中按最佳适配切出，集合中没有合适的才向系统申请。
+     * 最后一个区域中用不到的尾巴作为普通空闲span挂进桶里。只在_idSpanMap中登记首尾页
+     * @param k 申请的页数
+     * @param alignPages 首地址对齐的页数（2的幂），默认按页对齐
+     * @return span指针
+     */
+    Span *NewHugeSpan(size_t k, size_t alignPages = 1);
+
+    /**
+     * 原地扩展超大对象span：先并入最后一个区域中紧跟其后的空闲span，
+     * 不够时再并入紧跟在该区域之后的大块空闲span
+     * @param span 超大对象span
+     * @param k 扩展后的总页数
+     * @return 扩展成功返回true，span->_n变为k
+     */
+    bool TryGrowHugeSpan(Span *span, size_t k);
+
+    /**
+     * 原地缩小一个使用中的大对象/超大对象span，切下的页还给PC：
+     * 不完整区域中的部分按普通span归还（与区域中的空闲span合并），完整的区域进入大块空闲集合
+     * @param span 使用中的span
+     * @param k 缩小后的总页数（0 < k < span->_n）
+     */
+    void ShrinkSpan(Span *span, size_t k);
+
+    // 释放超大对象span：完整的区域进入大块空闲集合并与相邻的合并，
+    // 最后一个不完整区域中的部分按普通span归还到桶中
+    void ReleaseHugeSpan(Span *span);
+
     //DeBug:每个桶中span的数量
     void PrintDebugInfo()
     {
         std::cout << "=========== PageCache Info ===========" << std::endl;
-        // PageCache 的锁是把大锁 (_pageMtx)，通常在外部控制，或者这里为了调试只读一下
-        // 注意：PageCache 的 spanLists 数组本身没有独立的锁，而是由 _pageMtx 保护
-
-        // 这种调试打印在多线程高并发下通常需要小心，简单起见我们假设调试时没竞争
-        for (size_t i = 1; i < PAGE_NUM; ++i)
+        // 只访问位图中标记为非空的桶
+        for (size_t i = FindNonEmptyBucket(1); i < PAGE_NUM; i = FindNonEmptyBucket(i + 1))
         {
-            if (!_spanLists[i].Empty())
-            {
-                std::cout << "Bucket " << i << " (Pages): "
-                        << _spanLists[i].Size() << " spans" << std::endl;
-            }
+            std::lock_guard<std::mutex> lg(_spanLists[i].mtx);
+            std::cout << "Bucket " << i << " (Pages): "
+                    << _spanLists[i].Size() << " spans" << std::endl;
         }
         std::cout << "======================================" << std::endl;
     }
 
 private:
+#ifdef MEMORYPOOL_ARENA
+    PageCache() : _arena(ARENA_BYTES), _idSpanMap(_arena.BasePageId(), _arena.Pages())
+    {
+    }
+#else
     PageCache() = default;
+#endif
+
+    // 一个区域的页数，向系统申请的每块内存都是一个完整的区域
+    static const size_t REGION_PAGES = PAGE_NUM - 1;
+    // 区域锁的分段数，区域号取模后映射到其中一把
+    static const size_t REGION_LOCK_NUM = 64;
+    // 非空桶位图的字数，每个桶占一位
+    static const size_t BUCKET_WORDS = (PAGE_NUM + 63) / 64;
+
+    // 页号所在区域的锁
+    std::mutex &RegionMtx(size_t pageId)
+    {
+        return _regionMtx[(pageId / REGION_PAGES) % REGION_LOCK_NUM];
+    }
+
+    // 把span挂入/移出PC的桶（内部加桶锁），同时维护空闲页和已归还页的计数
+    // 调用前需持有span所在区域的锁。back为true时挂到桶尾
+    void PushSpan(Span *span, bool back = false);
+
+    void RemoveSpan(Span *span);
+
+    /**
+     * 在非空桶位图中找出下标 >= k 的第一个非空桶，不加锁
+     * 位图只在持有对应桶锁时修改，这里读到的结果可能已经过时，调用方加桶锁后需再确认
+     * @param k 起始桶下标
+     * @return 非空桶下标，没有时返回PAGE_NUM
+     */
+    size_t FindNonEmptyBucket(size_t k) const
+    {
+        size_t w = k / 64;
+        if (w >= BUCKET_WORDS)
+            return PAGE_NUM;
+        uint64_t bits = _nonEmpty[w].load(std::memory_order_relaxed) & (~(uint64_t) 0 << (k % 64));
+        while (true)
+        {
+            if (bits != 0)
+                return w * 64 + CountTrailingZeros(bits);
+            if (++w == BUCKET_WORDS)
+                return PAGE_NUM;
+            bits = _nonEmpty[w].load(std::memory_order_relaxed);
+        }
+    }
+
+    // 逐个桶查看位图中对应的位，找出下标 >= k 的第一个非空桶。只供NewSpanLinearScan对比使用
+    size_t FindNonEmptyBucketLinear(size_t k) const
+    {
+        for (; k < PAGE_NUM; ++k)
+        {
+            if (_nonEmpty[k / 64].load(std::memory_order_relaxed) & ((uint64_t) 1 << (k % 64)))
+                return k;
+        }
+        return PAGE_NUM;
+    }
+
+    // NewSpan和NewSpanLinearScan的实现，LinearScan选择查找非空桶的方式
+    template<bool LinearScan>
+    Span *NewSpanImpl(size_t k);
+
+    // 桶中挂入/取出span后同步位图，调用前需持有该桶的锁
+    void MarkBucket(size_t i)
+    {
+        uint64_t bit = (uint64_t) 1 << (i % 64);
+        if (_spanLists[i].Empty())
+            _nonEmpty[i / 64].fetch_and(~bit, std::memory_order_relaxed);
+        else
+            _nonEmpty[i / 64].fetch_or(bit, std::memory_order_relaxed);
+    }
+
+    /**
+     * 从第i个桶中取出一个span，并持有其所在区域的锁返回
+     * 持有桶锁时只能try_lock区域锁，拿不到就换下一个span
+     * @param i 桶下标
+     * @param contended 桶里有span但区域锁都被占用时置为true
+     * @param committedOnly 为true时只取仍占用物理内存（未归还）的span
+     * @return 取出的span，桶为空或全部被占用时返回nullptr
+     */
+    Span *PopSpanLocked(size_t i, bool &contended, bool committedOnly = false);
+
+    // 从一个不在任何桶中的空闲span上切下k页交出去，剩余部分挂回桶中
+    // 调用前需持有span所在区域的锁
+    Span *CarveSpan(Span *span, size_t k);
+
+    // 取一个首地址按alignPages对齐的完整区域（优先从大块空闲集合中取），并从中切下k页
+    Span *NewRegionSpan(size_t k, size_t alignPages);
+
+    /**
+     * 向系统申请内存扩充PC：按增长策略可能多申请一些，多出的部分放进大块空闲集合
+     * @param npages 本次需要的页数，必须是REGION_PAGES的整数倍
+     * @param alignPages 首地址对齐的页数（至少按一个区域对齐）
+     * @return 首地址对齐、恰好npages页的span（不在任何集合中）
+     */
+    Span *GrowHeap(size_t npages, size_t alignPages);
+
+    // 已归还的span重新分配出去之前要先提交内存
+    void CommitSpan(Span *span);
+
+    // 空闲字节超限或距离上次检查超过_releaseIdleMs时，调用ReleaseIdleSpans
+    void MaybeReleaseIdleSpans(size_t now, size_t keepPageId = 0);
+
+    /**
+     * 从大块空闲集合中按最佳适配（页数最小，其次地址最低）取出npages页
+     * 取出的是找到的span中第一个对齐点开始的部分，前后剩余部分留在集合中
+     * @param npages 页数，必须是REGION_PAGES的整数倍
+     * @param alignPages 首地址对齐的页数（2的幂，至少REGION_PAGES）
+     * @return 取出的span（不在任何集合中，_isReturned保持原状态），没有合适的返回nullptr
+     */
+    Span *TakeLargeSpan(size_t npages, size_t alignPages = REGION_PAGES);
+
+    // 把由完整区域组成的空闲span放入大块空闲集合，并与地址相邻且归还状态相同的span合并
+    void InsertLargeSpan(Span *span);
+
+    // InsertLargeSpan中合并并放入集合的部分，调用前需持有_largeMtx
+    void MergeLargeSpan(Span *span);
+
+    // 在两个集合中挂入/移除span，同时维护页数计数，调用前需持有_largeMtx
+    void PutLargeSpan(Span *span);
+
+    void EraseLargeSpan(Span *span);
+
+    // Span对象的申请与释放，由_spanPoolMtx保护
+    Span *NewSpanObject();
+
+    void DeleteSpanObject(Span *span);
 
     SpanList _spanLists[PAGE_NUM];
+    // 非空桶位图：第i位为1表示_spanLists[i]非空，用CountTrailingZeros一次跳过一整段空桶
+    std::atomic<uint64_t> _nonEmpty[BUCKET_WORDS] = {};
+    std::mutex _regionMtx[REGION_LOCK_NUM];
+
+    std::mutex _spanPoolMtx;
     ObjectPool<Span> _spanPool; // Span定长内存池
 
+    // 大块空闲集合：_largeBySize按(页数, 首页号)排序用于最佳适配，
+    // _largeByAddr按首页号排序用于查找相邻span合并，两者由_largeMtx保护
+    std::mutex _largeMtx;
+    std::set<std::pair<size_t, size_t>, std::less<std::pair<size_t, size_t> >,
+        PoolAllocator<std::pair<size_t, size_t> > > _largeBySize;
+    std::map<size_t, Span *, std::less<size_t>, PoolAllocator<std::pair<const size_t, Span *> > > _largeByAddr;
+
     // PageID和span地址的映射关系
     // 块地址右移13位可得当前块的页号，
     // 再通过这个哈希表可以直接得到该块所属的span地址
-    TCMalloc_PageMap3<48 - PAGE_SHIFT> _idSpanMap;
+#ifdef MEMORYPOOL_ARENA
+    // 地址空间预留模式：整个堆在一段连续的预留区中，映射用平坦数组
+    Arena _arena;
+    ArenaPageMap _idSpanMap;
+#else
+    // 具体实现由MEMORYPOOL_PAGEMAP在编译期选择，见PageMap.h
+    PageMap _idSpanMap;
+#endif
     // std::unordered_map<size_t, Span *> _idSpanMap;
+
+    // 回收策略
+    std::atomic<size_t> _releaseIdleMs{5000}; // 128页span空闲5秒后归还
+    std::atomic<size_t> _retainedLimit{64 << 20}; // 大块空闲集合最多保留64MB占用物理内存的空闲页
+    std::atomic<size_t> _lastReleaseTime{0}; // 上一次按空闲时间检查的时刻
+    // 增长策略
+    std::atomic<size_t> _growPages{HEAP_GROW_MIN_BYTES >> PAGE_SHIFT}; // 下一次向系统申请的页数
+    std::atomic<size_t> _growMaxPages{HEAP_GROW_MAX_BYTES >> PAGE_SHIFT}; // 单次申请的页数上限
+#ifdef MEMORYPOOL_HUGE_PAGES
+    std::atomic<bool> _hugePages{true}; // 是否用透明大页支撑
+#else
+    std::atomic<bool> _hugePages{false};
+#endif
+
+    std::atomic<size_t> _freePages{0}; // PC中仍占用物理内存的空闲页数
+    std::atomic<size_t> _largeFreePages{0}; // 其中在大块空闲集合里的页数，即ReleaseIdleSpans能回收的部分
+    std::atomic<size_t> _returnedPages{0}; // PC中已归还给操作系统的页数
+    std::atomic<size_t> _mappedPages{0}; // 向系统申请的页数，只增不减
 };
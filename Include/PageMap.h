@@ -0,0 +1,45 @@
+#pragma once
+#include "TCMalloc_PageMap1.h"
+#include "TCMalloc_PageMap2.h"
+#include "TCMalloc_PageMap3.h"
+
+/**
+ * 页号到span映射的实现策略，编译期按层数选择：
+ * 1 平坦数组：get一次访存，占256GB虚拟地址空间（按需提交）
+ * 2 两层基数树：get两次访存，根数组1MB
+ * 3 三层基数树：get三次访存，最省内存
+ * 所有实现都提供 set(pageId, span) 和无锁的 get(pageId)，
+ * 以及与之平行、每页一个的标记（PageTag）中的尺寸类：setClass(pageId, cls) 和 getClass(pageId)，
+ * 远程释放模式下标记里还有TC编号：setOwner(pageId, owner) 和 getOwner(pageId)；
+ * Ensure(start, n) 预先开辟一段页号的结构，之后读者不会与节点的开辟并发
+ * @tparam LEVELS 层数
+ * @tparam BITS 页号的位数
+ */
+template<int LEVELS, int BITS>
+struct PageMapPolicy;
+
+template<int BITS>
+struct PageMapPolicy<1, BITS>
+{
+    typedef TCMalloc_PageMap1<BITS> Type;
+};
+
+template<int BITS>
+struct PageMapPolicy<2, BITS>
+{
+    typedef TCMalloc_PageMap2<BITS> Type;
+};
+
+template<int BITS>
+struct PageMapPolicy<3, BITS>
+{
+    typedef TCMalloc_PageMap3<BITS> Type;
+};
+
+// 默认用三层基数树，CMake中用 -DMEMORYPOOL_PAGEMAP=1/2 切换
+#ifndef MEMORYPOOL_PAGEMAP
+#define MEMORYPOOL_PAGEMAP 3
+#endif
+
+// 64 位系统，48位虚拟地址空间，8KB一页
+typedef PageMapPolicy<MEMORYPOOL_PAGEMAP, 48 - PAGE_SHIFT>::Type PageMap;
@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include "Common.h"
+
+/**
+ * 分配器的统计快照（类似mallinfo）
+ * 各层平时只维护各自的计数（TC的计数只由本线程写），取快照时才逐层汇总：
+ * 不需要停下其它线程，读到的是各计数在某一时刻附近的近似值
+ */
+struct MemoryPoolStats
+{
+    // 按桶统计，下标为桶号
+    size_t allocs[FREE_LIST_NUM] = {}; // 经TC（或每CPU缓存的槽位）申请的块数，含已退出线程。每CPU缓存快路径的栈按批补充，按批计入
+    size_t frees[FREE_LIST_NUM] = {}; // 经TC释放的块数
+    size_t refills[FREE_LIST_NUM] = {}; // TC取空后向CC取块的次数
+    size_t centralObjs[FREE_LIST_NUM] = {}; // CC中空闲的块数（传输缓存 + span中未分出的块）
+
+    // 各层空闲的字节数
+    size_t threadCacheBytes = 0; // 所有TC缓存的字节数（含远程释放队列中的块）
+    size_t transferCacheBytes = 0; // CC传输缓存中的字节数
+    size_t centralCacheBytes = 0; // CC中空闲的字节数，包含传输缓存
+    size_t pageCacheFreeBytes = 0; // PC中空闲且仍占用物理内存的字节数
+    size_t returnedBytes = 0; // PC中已归还给操作系统的字节数
+
+    // 整体
+    size_t mappedBytes = 0; // 向系统申请的全部字节数（虚拟地址）
+    size_t committedBytes = 0; // mappedBytes减去归还给操作系统的部分，即仍交给本进程使用的字节数；
+                               // 没有碰过的页也算在内，不是实际驻留的物理内存（RSS）
+    size_t inUseBytes = 0; // 应用程序持有的字节数：committedBytes减去各层空闲的字节数（含块内对齐的浪费）
+};
+
+/**
+ * 汇总各层的统计
+ * @param stats [out] 统计快照
+ */
+void CollectStats(MemoryPoolStats &stats);
+
+/**
+ * 把快照格式化为JSON，按桶的统计只输出有过申请/释放或CC中有空闲块的桶
+ * @param stats 统计快照
+ * @return JSON字符串
+ */
+std::string StatsToJson(const MemoryPoolStats &stats);
@@ -0,0 +1,144 @@
+#pragma once
+#include "Common.h"
+
+// 平坦数组：每个页号直接对应一个槽位，get只有一次访存
+// BITS = 35 时数组占 2^35 * 8B = 256GB 的虚拟地址空间，只预留不提交：
+// Linux下按MAP_NORESERVE映射为可读写，内核在第一次写入某一页时才分配物理页，
+// 没写过的页读出来都是0；实际占用的物理内存 = 堆覆盖的地址范围 / 1024
+// Windows下不能提交这么大的范围，改为按块提交并用一个标记数组记录
+template<int BITS>
+class TCMalloc_PageMap1
+{
+private:
+    static const size_t LENGTH = (size_t) 1 << BITS;
+    static const size_t MAP_PAGES = (LENGTH * sizeof(void *)) >> PAGE_SHIFT;
+    static const size_t TAG_PAGES = (LENGTH * sizeof(PageTag)) >> PAGE_SHIFT;
+
+    std::atomic<void *> *values_;
+    // 与values_平行的每页标记（尺寸类，远程释放模式下还有TC编号），同样按需提交
+    std::atomic<PageTag> *classes_;
+
+#ifdef _WIN32
+    // 每次提交的槽位数（64KB）
+    static const int CHUNK_BITS = 13;
+    std::atomic<uint8_t> *_committed;
+    std::mutex _ensureMtx;
+#endif
+
+    // 读取每页的标记，超出范围（或Windows下还没提交）时返回0
+    PageTag getTag(size_t pageId) const
+    {
+        if ((pageId >> BITS) != 0)
+        {
+            return 0;
+        }
+#ifdef _WIN32
+        if (!_committed[pageId >> CHUNK_BITS].load(std::memory_order_acquire))
+        {
+            return 0;
+        }
+#endif
+        return classes_[pageId].load(std::memory_order_relaxed);
+    }
+
+public:
+    TCMalloc_PageMap1()
+    {
+        values_ = (std::atomic<void *> *) SystemReserve(MAP_PAGES, 1);
+        classes_ = (std::atomic<PageTag> *) SystemReserve(TAG_PAGES, 1);
+#ifdef _WIN32
+        size_t chunks = LENGTH >> CHUNK_BITS;
+        _committed = (std::atomic<uint8_t> *) SystemAlloc((chunks + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+#else
+        SystemCommitReserved(values_, MAP_PAGES);
+        SystemCommitReserved(classes_, TAG_PAGES);
+#endif
+    }
+
+    // 确保某个 PageID 对应的槽位可写
+    void Ensure(size_t pageId)
+    {
+#ifdef _WIN32
+        const size_t c = pageId >> CHUNK_BITS;
+        if (_committed[c].load(std::memory_order_acquire))
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lg(_ensureMtx);
+        if (!_committed[c].load(std::memory_order_relaxed))
+        {
+            SystemCommitReserved(values_ + (c << CHUNK_BITS), ((sizeof(void *) << CHUNK_BITS) >> PAGE_SHIFT));
+            SystemCommitReserved(classes_ + (c << CHUNK_BITS), ((sizeof(PageTag) << CHUNK_BITS) >> PAGE_SHIFT));
+            _committed[c].store(1, std::memory_order_release);
+        }
+#else
+        (void) pageId;
+#endif
+    }
+
+    // 预先提交[start, start + n)这段页号的槽位
+    void Ensure(size_t start, size_t n)
+    {
+#ifdef _WIN32
+        for (size_t key = start; key < start + n; key = ((key >> CHUNK_BITS) + 1) << CHUNK_BITS)
+        {
+            Ensure(key);
+        }
+#else
+        (void) start;
+        (void) n;
+#endif
+    }
+
+    // 建立映射关系（写入 Span*）
+    void set(size_t pageId, void *span)
+    {
+        Ensure(pageId);
+        values_[pageId].store(span, std::memory_order_relaxed);
+        classes_[pageId].store(0, std::memory_order_relaxed); // 页的归属变了，原来登记的尺寸类作废
+    }
+
+    // 登记小对象页的尺寸类（桶下标 + 1），调用前该页必须已经set过
+    void setClass(size_t pageId, size_t cls)
+    {
+        classes_[pageId].store((PageTag) cls, std::memory_order_relaxed);
+    }
+
+    // 读取尺寸类，0表示该页不属于小对象span，不加锁
+    size_t getClass(size_t pageId) const
+    {
+        return getTag(pageId) & PAGE_TAG_CLASS_MASK;
+    }
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 登记最近从该页所在span取块的TC编号，与尺寸类放在同一个标记里，调用前该页必须已经setClass过
+    void setOwner(size_t pageId, uint32_t owner)
+    {
+        std::atomic<PageTag> &tag = classes_[pageId];
+        tag.store((PageTag) owner << PAGE_TAG_CLASS_BITS | (tag.load(std::memory_order_relaxed) & PAGE_TAG_CLASS_MASK),
+                  std::memory_order_relaxed);
+    }
+
+    // 读取TC编号，0表示没有登记，不加锁
+    uint32_t getOwner(size_t pageId) const
+    {
+        return getTag(pageId) >> PAGE_TAG_CLASS_BITS;
+    }
+#endif
+
+    // 获取映射关系（读取 Span*），不加锁
+    void *get(size_t pageId) const
+    {
+        if ((pageId >> BITS) != 0)
+        {
+            return nullptr;
+        }
+#ifdef _WIN32
+        if (!_committed[pageId >> CHUNK_BITS].load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+#endif
+        return values_[pageId].load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+#include <cstring>
+#include "Common.h"
+
+// 两层基数树：BITS = 35 时拆成 17 bits 的根数组和 18 bits 的叶子
+// 根数组（1MB）直接放在对象里，叶子（2MB，另有每页一个的标记，覆盖2GB地址空间）按需向系统申请
+// get只有两次访存，其中第一次的地址是固定的
+template<int BITS>
+class TCMalloc_PageMap2
+{
+private:
+    static const int LEAF_BITS = (BITS + 1) / 2;
+    static const int ROOT_BITS = BITS - LEAF_BITS;
+
+    static const size_t ROOT_LENGTH = (size_t) 1 << ROOT_BITS;
+    static const size_t LEAF_LENGTH = (size_t) 1 << LEAF_BITS;
+
+    // 叶子节点结构
+    struct Leaf
+    {
+        std::atomic<void *> values[LEAF_LENGTH];
+        // 与values平行的每页标记（尺寸类，远程释放模式下还有TC编号），见setClass
+        std::atomic<PageTag> classes[LEAF_LENGTH];
+    };
+
+    // 根数组，叶子指针开辟好之后才发布，读者不加锁
+    std::atomic<Leaf *> root_[ROOT_LENGTH];
+
+    // 开辟叶子时加锁
+    std::mutex _ensureMtx;
+
+    // 读取每页的标记，叶子还没开辟时返回0
+    PageTag getTag(size_t pageId) const
+    {
+        const size_t i1 = pageId >> LEAF_BITS;
+        const size_t i2 = pageId & (LEAF_LENGTH - 1);
+        if ((pageId >> BITS) != 0)
+        {
+            return 0;
+        }
+        Leaf *l = root_[i1].load(std::memory_order_acquire);
+        if (l == nullptr)
+        {
+            return 0;
+        }
+        return l->classes[i2].load(std::memory_order_relaxed);
+    }
+
+public:
+    TCMalloc_PageMap2()
+    {
+        for (size_t i = 0; i < ROOT_LENGTH; ++i)
+        {
+            root_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // 确保某个 PageID 对应的叶子已经被开辟
+    void Ensure(size_t pageId)
+    {
+        const size_t i1 = pageId >> LEAF_BITS;
+        if (root_[i1].load(std::memory_order_acquire) != nullptr)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lg(_ensureMtx);
+        if (root_[i1].load(std::memory_order_relaxed) == nullptr)
+        {
+            // 叶子按页向系统申请，匿名映射天然是全0
+            Leaf *l = (Leaf *) SystemAlloc((sizeof(Leaf) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+            root_[i1].store(l, std::memory_order_release);
+        }
+    }
+
+    // 预先开辟[start, start + n)这段页号的全部叶子
+    void Ensure(size_t start, size_t n)
+    {
+        for (size_t key = start; key < start + n; key = ((key >> LEAF_BITS) + 1) << LEAF_BITS)
+        {
+            Ensure(key);
+        }
+    }
+
+    // 建立映射关系（写入 Span*）
+    void set(size_t pageId, void *span)
+    {
+        Ensure(pageId);
+        const size_t i1 = pageId >> LEAF_BITS;
+        const size_t i2 = pageId & (LEAF_LENGTH - 1);
+        Leaf *l = root_[i1].load(std::memory_order_relaxed);
+        l->values[i2].store(span, std::memory_order_relaxed);
+        l->classes[i2].store(0, std::memory_order_relaxed); // 页的归属变了，原来登记的尺寸类作废
+    }
+
+    // 登记小对象页的尺寸类（桶下标 + 1），调用前该页必须已经set过
+    void setClass(size_t pageId, size_t cls)
+    {
+        const size_t i1 = pageId >> LEAF_BITS;
+        const size_t i2 = pageId & (LEAF_LENGTH - 1);
+        root_[i1].load(std::memory_order_relaxed)->classes[i2].store((PageTag) cls, std::memory_order_relaxed);
+    }
+
+    // 读取尺寸类，0表示该页不属于小对象span，不加锁
+    size_t getClass(size_t pageId) const
+    {
+        return getTag(pageId) & PAGE_TAG_CLASS_MASK;
+    }
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 登记最近从该页所在span取块的TC编号，与尺寸类放在同一个标记里，调用前该页必须已经setClass过
+    void setOwner(size_t pageId, uint32_t owner)
+    {
+        const size_t i1 = pageId >> LEAF_BITS;
+        const size_t i2 = pageId & (LEAF_LENGTH - 1);
+        std::atomic<PageTag> &tag = root_[i1].load(std::memory_order_relaxed)->classes[i2];
+        tag.store((PageTag) owner << PAGE_TAG_CLASS_BITS | (tag.load(std::memory_order_relaxed) & PAGE_TAG_CLASS_MASK),
+                  std::memory_order_relaxed);
+    }
+
+    // 读取TC编号，0表示没有登记，不加锁
+    uint32_t getOwner(size_t pageId) const
+    {
+        return getTag(pageId) >> PAGE_TAG_CLASS_BITS;
+    }
+#endif
+
+    // 获取映射关系（读取 Span*），不加锁
+    void *get(size_t pageId) const
+    {
+        const size_t i1 = pageId >> LEAF_BITS;
+        const size_t i2 = pageId & (LEAF_LENGTH - 1);
+        if ((pageId >> BITS) != 0)
+        {
+            return nullptr;
+        }
+        Leaf *l = root_[i1].load(std::memory_order_acquire);
+        if (l == nullptr)
+        {
+            return nullptr;
+        }
+        return l->values[i2].load(std::memory_order_relaxed);
+    }
+};
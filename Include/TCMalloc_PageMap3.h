@@ -8,6 +8,7 @@
 #endif //MEMORYPOOL_TCMALLOC_PAGE3_H
 
 #pragma once
+#include <cstring>
 #include "Common.h"
 #include "ObjectPool.h"
 
@@ -15,6 +16,13 @@
 // PageID 共有 48 - 13 = 35 bits
 // 我们将其拆分为三层目录：15 bits, 10 bits, 10 bits
 // BITS = 35
+//
+// 并发约定：
+// 1. get/getClass/getOwner完全无锁。中间节点和叶子在写满0之后才用release发布，
+//    读者用acquire读取，在ARM等弱内存序的CPU上也不会看到未初始化的节点
+// 2. 节点只增不删，一旦发布就一直有效
+// 3. 槽位本身用relaxed读写：同一页的映射只在该页不被其它线程使用时改变，
+//    读者拿到的span由它持有的对象本身保证可见性
 template<int BITS>
 class TCMalloc_PageMap3
 {
@@ -33,52 +41,110 @@ private:
     // 叶子节点结构
     struct Leaf
     {
-        void* values[LEAF_LENGTH];
+        std::atomic<void*> values[LEAF_LENGTH];
+        // 与values平行的每页标记（尺寸类，远程释放模式下还有TC编号），见setClass
+        std::atomic<PageTag> classes[LEAF_LENGTH];
     };
 
     // 中间节点结构
     struct Node
     {
-        Leaf* leafs[INTERIOR_LENGTH];
+        std::atomic<Leaf*> leafs[INTERIOR_LENGTH];
     };
 
     // 顶层目录数组
-    Node* root_[ROOT_LENGTH];
+    std::atomic<Node*> root_[ROOT_LENGTH];
 
+    // ObjectPool本身不是线程安全的，只在持有_ensureMtx时使用
     ObjectPool<Leaf> _leafPool;
     ObjectPool<Node> _nodePool;
 
+    // 开辟中间节点/叶子节点时加锁。PC的span路径和大对象直通路径
+    // 不再共用同一把锁，两边都可能调用set，因此Ensure需要自己保护
+    std::mutex _ensureMtx;
+
+    // 读取页号所在的叶子，结构还没建立时返回nullptr
+    Leaf* LeafOf(size_t pageId) const
+    {
+        const size_t i1 = pageId >> (LEAF_BITS + INTERIOR_BITS2);
+        const size_t i2 = (pageId >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        if ((pageId >> BITS) != 0)
+        {
+            return nullptr;
+        }
+
+        Node* n = root_[i1].load(std::memory_order_acquire);
+        if (n == nullptr)
+        {
+            return nullptr;
+        }
+        return n->leafs[i2].load(std::memory_order_acquire);
+    }
+
+    // 读取每页的标记，结构还没建立时返回0
+    PageTag getTag(size_t pageId) const
+    {
+        Leaf* l = LeafOf(pageId);
+        if (l == nullptr)
+        {
+            return 0;
+        }
+        return l->classes[pageId & (LEAF_LENGTH - 1)].load(std::memory_order_relaxed);
+    }
+
 public:
     TCMalloc_PageMap3()
     {
         // 只初始化第一层
-        memset(root_, 0, sizeof(root_));
+        for (int i = 0; i < ROOT_LENGTH; ++i)
+        {
+            root_[i].store(nullptr, std::memory_order_relaxed);
+        }
     }
 
-    // 确保某个 PageID 对应的层级结构已经被开辟（需要加全局锁调用）
+    // 确保某个 PageID 对应的层级结构已经被开辟，可以与get/set并发调用
     void Ensure(size_t pageId)
     {
+        // 绝大多数情况下结构早已存在，先无锁检查一遍，避免每次set都抢锁
+        if (LeafOf(pageId) != nullptr)
+        {
+            return;
+        }
+
         // 计算每一层的索引
         const size_t i1 = pageId >> (LEAF_BITS + INTERIOR_BITS2);
         const size_t i2 = (pageId >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
 
+        std::lock_guard<std::mutex> lg(_ensureMtx);
+
         // 如果第一层对应的中间节点不存在，开辟它
-        if (root_[i1] == nullptr)
+        Node* n = root_[i1].load(std::memory_order_relaxed);
+        if (n == nullptr)
         {
             // 注意：如果在内核/极底层的内存池开发中，不能用 new，需要用 SystemAlloc
             // Node *n = new Node;
-            Node* n = _nodePool.New();
-            memset(n, 0, sizeof(*n));
-            root_[i1] = n;
+            n = _nodePool.New();
+            memset((void*) n, 0, sizeof(*n));
+            root_[i1].store(n, std::memory_order_release); // 清零之后再发布
         }
 
         // 如果第二层对应的叶子节点不存在，开辟它
-        if (root_[i1]->leafs[i2] == nullptr)
+        if (n->leafs[i2].load(std::memory_order_relaxed) == nullptr)
         {
             // Leaf *l = new Leaf;
             Leaf* l= _leafPool.New();
-            memset(l, 0, sizeof(*l));
-            root_[i1]->leafs[i2] = l;
+            memset((void*) l, 0, sizeof(*l));
+            n->leafs[i2].store(l, std::memory_order_release);
+        }
+    }
+
+    // 预先开辟[start, start + n)这段页号的全部结构
+    // 之后这段范围内的set不会再进入加锁的分支，get也不会与节点的开辟并发
+    void Ensure(size_t start, size_t n)
+    {
+        for (size_t key = start; key < start + n; key = ((key >> LEAF_BITS) + 1) << LEAF_BITS)
+        {
+            Ensure(key);
         }
     }
 
@@ -87,25 +153,50 @@ public:
     void set(size_t pageId, void *span)
     {
         Ensure(pageId); // 保底检查
-        const size_t i1 = pageId >> (LEAF_BITS + INTERIOR_BITS2); // 第一层地址
-        const size_t i2 = (pageId >> LEAF_BITS) & (INTERIOR_LENGTH - 1); // 第二层地址
-        const size_t i3 = pageId & (LEAF_LENGTH - 1); //
+        Leaf* l = LeafOf(pageId);
+        const size_t i3 = pageId & (LEAF_LENGTH - 1);
 
-        root_[i1]->leafs[i2]->values[i3] = span;
+        l->values[i3].store(span, std::memory_order_relaxed);
+        l->classes[i3].store(0, std::memory_order_relaxed); // 页的归属变了，原来登记的尺寸类作废
     }
 
-    // 获取映射关系（读取 Span*）这个函数是完全无锁的
-    void *get(size_t pageId)
+    // 登记小对象页的尺寸类（桶下标 + 1），调用前该页必须已经set过
+    void setClass(size_t pageId, size_t cls)
     {
-        const size_t i1 = pageId >> (LEAF_BITS + INTERIOR_BITS2);
-        const size_t i2 = (pageId >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
-        const size_t i3 = pageId & (LEAF_LENGTH - 1);
+        LeafOf(pageId)->classes[pageId & (LEAF_LENGTH - 1)].store((PageTag) cls, std::memory_order_relaxed);
+    }
 
+    // 读取尺寸类，0表示该页不属于小对象span。与get一样不加锁
+    size_t getClass(size_t pageId) const
+    {
+        return getTag(pageId) & PAGE_TAG_CLASS_MASK;
+    }
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 登记最近从该页所在span取块的TC编号，与尺寸类放在同一个标记里，调用前该页必须已经setClass过
+    void setOwner(size_t pageId, uint32_t owner)
+    {
+        std::atomic<PageTag> &tag = LeafOf(pageId)->classes[pageId & (LEAF_LENGTH - 1)];
+        tag.store((PageTag) owner << PAGE_TAG_CLASS_BITS | (tag.load(std::memory_order_relaxed) & PAGE_TAG_CLASS_MASK),
+                  std::memory_order_relaxed);
+    }
+
+    // 读取TC编号，0表示没有登记。与get一样不加锁
+    uint32_t getOwner(size_t pageId) const
+    {
+        return getTag(pageId) >> PAGE_TAG_CLASS_BITS;
+    }
+#endif
+
+    // 获取映射关系（读取 Span*）这个函数是完全无锁的
+    void *get(size_t pageId) const
+    {
         // 只要树干被建立过了，读取就是原子的
-        if (root_[i1] == nullptr || root_[i1]->leafs[i2] == nullptr)
+        Leaf* l = LeafOf(pageId);
+        if (l == nullptr)
         {
             return nullptr;
         }
-        return root_[i1]->leafs[i2]->values[i3];
+        return l->values[pageId & (LEAF_LENGTH - 1)].load(std::memory_order_relaxed);
     }
 };
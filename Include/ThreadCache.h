@@ -1,17 +1,102 @@
 #pragma once
 #include "Common.h"
+#include "ObjectPool.h"
+#include "Stats.h"
+#include <chrono>
+
+// 远程释放模式依赖TC的内存在线程退出后仍然有效（来自定长内存池），
+// Windows下TC是thread_local对象；每CPU缓存则没有“所属线程”的概念
+#if defined(MEMORYPOOL_REMOTE_FREE) && (defined(_WIN32) || defined(MEMORYPOOL_PER_CPU))
+#error "MEMORYPOOL_REMOTE_FREE requires the thread-local front end on POSIX"
+#endif
 
 class ThreadCache
 {
 private:
-    FreeList _freeLists[FREE_LIST_NUM]; //哈希桶，每个桶都是一个自由链表
+    FreeList _freeLists[FREE_LIST_NUM]; //哈希桶，每个桶都是一个指针数组栈
+
+    // 所有桶的指针数组连续放在一块向系统申请的内存里，每个桶的容量为两批（2 * ClassBatch）
+    // 只预留地址空间，物理页在桶第一次用到时才分配
+    void **_slots = nullptr;
+    size_t _slotPages = 0;
+
+    // 全局预算：所有TC缓存的总字节数受THREAD_CACHE_TOTAL_BYTES约束
+    // 每个TC持有一份预算_maxBytes，缓存字节数_cachedBytes超过预算时，
+    // 先尝试从未分配的预算里领取，领不到就从其它TC那里“偷”，再不行只能自己收缩
+    OwnedCounter _cachedBytes; // 当前所有自由链表缓存的字节数（只有本线程写，统计时其它线程会读）
+    std::atomic<size_t> _maxBytes{0}; // 本TC的预算，可能被其它线程偷走一部分
+    std::atomic<bool> _shrinkPending{false}; // 预算被偷或被收回后置位，本线程下次走慢路径（取空/溢出/超预算）时收缩
+
+    // 上次按低水位归还空闲块的时间，只在和CC交互的慢路径上检查
+    std::chrono::steady_clock::time_point _lastRelease = std::chrono::steady_clock::now();
+
+    // 上次扩大预算失败的时间：之后一个THREAD_CACHE_RELEASE_MS周期内超预算直接收缩，不再去抢全局锁
+    std::chrono::steady_clock::time_point _lastGrowFail;
+
+    // 所有TC串成一个双向链表，由_registryMtx保护，用于挑选被偷的对象
+    ThreadCache *_nextCache = nullptr;
+    ThreadCache *_prevCache = nullptr;
+
+    static std::mutex _registryMtx;
+    static ThreadCache *_registryHead;
+    static ThreadCache *_nextVictim; // 轮询偷取的下一个候选
+    static size_t _totalBudget; // 所有TC的总预算
+    static size_t _claimedBudget; // 已经分给各TC的预算之和（偷取通常只在TC之间转移；超过总预算时偷到的直接收回）
+
+    // 按桶的申请/释放/取块次数，只有本线程写，由CollectStats在注册表上汇总
+    OwnedCounter _allocs[FREE_LIST_NUM];
+    OwnedCounter _frees[FREE_LIST_NUM];
+    OwnedCounter _refills[FREE_LIST_NUM];
+
+    // 已经析构的TC留下的计数，由_registryMtx保护
+    static size_t _retiredAllocs[FREE_LIST_NUM];
+    static size_t _retiredFrees[FREE_LIST_NUM];
+    static size_t _retiredRefills[FREE_LIST_NUM];
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 远程释放队列：其它线程释放从本TC取走的块时，无锁地压入这里（多生产者单消费者）。
+    // 本TC在某个自由链表取空时（以及ReleaseIdle的每个周期）一次性摘走整条队列，按页号映射中的尺寸类挂回各自由链表，
+    // 生产者/消费者分属两个线程时，块直接回到申请方，不用经过CC的桶锁
+    // 不用默认初始化：TC的内存会被复用，别的线程可能仍拿着旧指针并发地CAS，构造函数里用原子写清空
+    std::atomic<void *> _remoteFree;
+
+    // 队列中（含正在推入）的块的字节数，计入统计的线程缓存字节数。推入方CAS之前先加，被拒绝时减回，
+    // 摘取方按摘走的块减去，所以TC析构（队列关闭并摘空）之后总会回到0。
+    // 同样不初始化，也不在构造函数里清零，否则会冲掉拿着旧指针的推入方刚加上的数（定长内存池的新内存全为0）
+    std::atomic<size_t> _remoteBytes;
+
+    // 按编号找到TC，释放方不加锁读取。TC析构时清空自己的编号，编号随后可以分给新的TC
+    static std::atomic<ThreadCache *> _remoteOwners[REMOTE_OWNER_NUM];
+    static uint32_t _nextOwnerId; // 分配编号时轮询的起点，由_registryMtx保护
+#endif
+
+    // 远程释放模式下本TC在_remoteOwners中的编号，CC把它登记到取走的span的各页上；
+    // 编号用完或其它模式下为0（不登记）
+    uint32_t _ownerId = 0;
 
 public:
+    ThreadCache();
+
+#ifdef _WIN32
     static ThreadCache *getInstance()
     {
         static thread_local ThreadCache pTLSThreadCache;
         return &pTLSThreadCache;
     }
+#else
+    // TLS里只放一个指针：带析构函数的thread_local对象在首次访问时要注册析构函数，
+    // glibc注册时会调用calloc，接管malloc后就会递归回到这里。
+    // 因此TC从定长内存池分配，线程退出时由pthread key的析构回调负责回收
+    static ThreadCache *getInstance()
+    {
+        ThreadCache *&slot = TLSSlot();
+        if (slot == nullptr)
+        {
+            slot = CreateInstance();
+        }
+        return slot;
+    }
+#endif
 
     ~ThreadCache();
 
@@ -21,23 +106,185 @@ public:
     //TC回收线程的空间
     void Deallocate(void *obj, size_t size);
 
+    // 按桶下标回收，调用方已经知道size对应的桶（如带大小的释放）
+    void DeallocateByIndex(void *obj, size_t index);
+
+    /**
+     * 一次申请n个同样大小的块：桶下标只算一次，先整段取走本桶缓存的块，
+     * 不够的部分直接向CC按需要的数量一次取回
+     * @param size 块大小（<= MAX_BYTES）
+     * @param ptrs [out] 存放块指针的数组，长度至少为n
+     * @param n 块数
+     */
+    void AllocateBatch(size_t size, void **ptrs, size_t n);
+
+    /**
+     * 一次回收n个同一桶的块：按桶的剩余容量分段memcpy进指针数组，再按需整批还给CC
+     * 远程释放模式下和DeallocateByIndex一样把别的TC的块还给它，连续属于同一个TC的一段只推一次
+     * @param ptrs 块指针数组
+     * @param n 块数
+     * @param index 桶下标
+     */
+    void DeallocateBatch(void **ptrs, size_t n, size_t index);
+
+    /**
+     * 每CPU缓存的槽位用：本桶非空时弹出一个块，否则返回nullptr（不向CC申请）
+     * @param index 桶下标
+     * @return 内存块指针
+     */
+    void *TryAllocate(size_t index);
+
+    /**
+     * 每CPU缓存的槽位用：只从本桶缓存中取最多n个块，不向CC申请，按申请计数
+     * @param index 桶下标
+     * @param ptrs [out] 存放块指针的数组，长度至少为n
+     * @param n 最多取的块数
+     * @return 取到的块数，本桶为空时为0
+     */
+    size_t TakeCached(size_t index, void **ptrs, size_t n);
+
+    /**
+     * 每CPU缓存的槽位用：FetchFromCentralCache拆成的前一半。做一次空闲回收检查，
+     * 按慢启动算出这次应向CC取的块数。调用方随后释放槽位的锁，自己向CC取块，再调用EndFetch
+     * @param index 桶下标
+     * @return 应向CC取的块数
+     */
+    size_t BeginFetch(size_t index);
+
+    /**
+     * 每CPU缓存的槽位用：FetchFromCentralCache拆成的后一半
+     * @param index 桶下标
+     * @param objs 从CC取回的块
+     * @param n 块数（至少为1）
+     * @return 第一个块，交给申请方，其余挂进本桶
+     */
+    void *EndFetch(size_t index, void **objs, size_t n);
+
+    /**
+     * 每CPU缓存的槽位用：调用方没有经过本TC、直接向CC取了块，把次数计入本TC的统计
+     * @param index 桶下标
+     * @param n 取到的块数
+     * @param fetches 向CC取块的次数
+     */
+    void CountFetch(size_t index, size_t n, size_t fetches)
+    {
+        _allocs[index] += n;
+        _refills[index] += fetches;
+    }
+
+    /**
+     * 每CPU缓存的槽位用：快路径的栈中还有extraBytes字节记在本槽位名下，和本TC缓存的字节数一起受预算约束。
+     * 合计超出时先尝试扩大预算
+     * @param extraBytes 快路径栈中的字节数
+     * @return 扩不了预算（或预算刚被偷走/收回）时返回false，调用方应把栈倒回本TC，由它收缩到预算以内
+     */
+    bool ChargeExtra(size_t extraBytes);
+
+    // 距上次ReleaseIdle是否已经超过THREAD_CACHE_RELEASE_MS
+    bool ReleaseDue() const
+    {
+        return std::chrono::steady_clock::now() - _lastRelease >= std::chrono::milliseconds(THREAD_CACHE_RELEASE_MS);
+    }
+
     /**
      * TC桶向CC申请空间 ，申请的块数量由maxSize和人为设定上限取低
-     * 但CC实际不一定能分配这么多
+     * 但CC实际不一定能分配这么多。取空也是调整MaxSize的时机：慢启动到一批，之后连续取空则再加一批
      * @param index 桶下表
      * @param alignSize 对齐后的块大小
-     * @return 块链的头指针
+     * @return 分给线程的一个块，其余的压入桶中
      */
     void *FetchFromCentralCache(size_t index, size_t alignSize);
 
     /**
      * 当TC桶内自由链表长度大于其_maxSize。则会调用该函数
-     * 弹出_maxSize个内存块
+     * 弹出_maxSize个内存块（不超过一批）；MaxSize高于一批时，连续溢出会让它减少一批
      * @param list 自由链表
      * @param size 对齐后的内存块大小
      */
     void ListTooLong(FreeList &list, size_t size);
 
+    /**
+     * 缓存字节数超过预算时调用：先尝试扩大预算，失败则收缩自身（失败后一个THREAD_CACHE_RELEASE_MS周期内不再尝试）
+     */
+    void OverBudget();
+
+    /**
+     * 为本TC争取更多预算：优先领取未分配的预算，其次轮询偷取其它TC的预算。
+     * 已分配的预算超过总预算（总预算被调小）时，偷到的预算不给自己，而是直接收回
+     * @return 是否成功扩大了预算
+     */
+    bool GrowBudget();
+
+    // 把每个自由链表的一半还给CC，直到缓存字节数回到预算以内
+    void Scavenge();
+
+    /**
+     * 距上次超过THREAD_CACHE_RELEASE_MS时，把每个桶低水位的一半还给CC：
+     * 低水位以下的块整个周期都没被用到，MaxSize也随之回落，桶的大小跟着负载的阶段变化
+     * 预算被偷走或收回过（_shrinkPending）时，先收缩到新的预算；
+     * 远程释放模式下同时摘取远程释放队列，其中的块和本地缓存一样受预算约束
+     */
+    void ReleaseIdle();
+
+    /**
+     * 把本TC缓存的所有块直接还给CC的span（不经过传输缓存），变空的span随即还给PC；
+     * 各个桶重新慢启动，预算保持不变。供线程池的线程在空闲前主动调用
+     * @return 交出的字节数
+     */
+    size_t Flush();
+
+    /**
+     * 汇总所有TC（含已析构的）的按桶计数和缓存字节数，只在遍历注册表时持有_registryMtx
+     * @param stats [in/out] 累加到这里
+     */
+    static void CollectStats(MemoryPoolStats &stats);
+
+    // 设置所有TC的总预算（字节）。调小时立即从各TC收回超出的预算，各TC在下一次慢路径上收缩
+    static void SetTotalBudget(size_t bytes);
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    /**
+     * 其它线程把一段已经用ObjNext串好的块（head到tail）一次推进本TC的远程释放队列
+     * @param head 第一个块
+     * @param tail 最后一个块，单个块时与head相同
+     * @param bytes 这些块对齐后的总字节数，计入_remoteBytes
+     * @return 本TC已经关闭（线程正在退出）时返回false，调用方改为在自己的TC中释放
+     */
+    bool PushRemote(void *head, void *tail, size_t bytes);
+
+    /**
+     * 摘走远程释放队列中的全部块，挂回对应的自由链表
+     * @param close 为true时同时关闭队列（线程退出时）
+     */
+    void DrainRemote(bool close = false);
+#endif
+
+private:
+    // Flush和析构共用：清空所有桶，返回交出的字节数
+    size_t ReleaseAll();
+
+    // 取空时按慢启动调整MaxSize，返回这次应向CC取的块数
+    size_t NextFetchNum(FreeList &list, size_t index);
+
+    // 把n个块压入桶中：按剩余容量分段拷入，每段之后整批还给CC直到回到MaxSize以内
+    void PushBatch(FreeList &list, void *const *ptrs, size_t n, size_t alignSize);
+
+#ifndef _WIN32
+    static ThreadCache *&TLSSlot()
+    {
+        static thread_local ThreadCache *pTLSThreadCache MEMORYPOOL_TLS_MODEL = nullptr;
+        return pTLSThreadCache;
+    }
+
+    // 为当前线程创建TC并登记线程退出回调
+    static ThreadCache *CreateInstance();
+
+    // pthread key的析构回调：线程退出时把TC的内存还给CC，再把TC本身还给定长内存池
+    static void DestroyInstance(void *tc);
+#endif
+
+public:
+
 
     // DeBug:打印内存块数量
     void PrintDebugInfo()
@@ -51,6 +298,7 @@ public:
                         << _freeLists[i].Size() << " blocks(_maxSize=" << _freeLists[i].MaxSize() << ")" << std::endl;
             }
         }
+        std::cout << "Cached " << _cachedBytes << " bytes, budget " << _maxBytes.load() << " bytes" << std::endl;
         std::cout << "======================================" << std::endl;
     }
 };
@@ -5,11 +5,41 @@
 #include "CentralCache.h"
 #include "PageCache.h"
 
-size_t CentralCache::FetchRangeObj(void *&start, void *&end, size_t batchNum, size_t size)
+CentralCache::CentralCache()
+{
+    // 所有桶的传输缓存连续放在一块向系统申请的内存里，物理页在用到时才分配
+    size_t total = 0;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        total += TransferCapacity(i) * SizeClass::ClassBatch(i);
+    }
+    void **slots = (void **) SystemAlloc((total * sizeof(void *) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        _transferCaches[i].capacity = TransferCapacity(i) * SizeClass::ClassBatch(i);
+        _transferCaches[i].slots = slots;
+        slots += _transferCaches[i].capacity;
+    }
+}
+
+size_t CentralCache::FetchRangeObj(void **ptrs, size_t batchNum, size_t size, uint32_t owner)
 {
     // 为什么这里不直接传入index？
     size_t index = SizeClass::Index(size);
 
+    // 0. 先看传输缓存：有的话从栈顶拷走，最多batchNum个
+    {
+        TransferCache &tc = _transferCaches[index];
+        std::lock_guard<SpinLock> lg(tc.lock);
+        if (tc.count > 0)
+        {
+            size_t n = std::min(tc.count, batchNum);
+            tc.count -= n;
+            memcpy(ptrs, tc.slots + tc.count, n * sizeof(void *));
+            return n;
+        }
+    }
+
     // 获取一个非空的span指针，从该span的frreList上取下连续内存块，整个过程加锁
     {
         std::unique_lock<std::mutex> lg(_spanLists[index].mtx);
@@ -17,30 +47,97 @@ size_t CentralCache::FetchRangeObj(void *&start, void *&end, size_t batchNum, si
         assert(span);
         assert(span->_freeList);
 
-        // 选中内存块链表
-        // 1. end 向后挪动batchNum-1个位置
-        // 2. 如果span可用的块小于batchNum，需提前结束，即Next(end)!=nullptr
-        // 3. 需要对end后移的次数计数以返回实际分配的块数量
-        start = end = span->_freeList;
-        size_t actualNum = 1;
-        while (actualNum < batchNum && ObjNext(end) != nullptr)
+        // 沿span的freeList取块写进数组，span可用的块小于batchNum时提前结束
+        void *cur = span->_freeList;
+        size_t actualNum = 0;
+        while (actualNum < batchNum && cur != nullptr)
         {
-            end = ObjNext(end);
-            actualNum++;
+            ptrs[actualNum++] = cur;
+            cur = ObjNext(cur);
         }
 
-        // 将选中的内存块链表从span的freeLsit上断开
-        // 1. span的freeList指向next(end)
-        // 2. 实际分配了多少块，span的usecount增加多少
-        // 3. 将next(end)设为nullptr使其与span断开连接即可
-        span->_freeList = ObjNext(end);
+        // span的freeList指向剩下的部分，实际分配了多少块，span的usecount增加多少
+        span->_freeList = cur;
         span->_usecount += actualNum;
-        ObjNext(end) = nullptr;
+        _spanFreeObjs[index] -= actualNum;
+#ifdef MEMORYPOOL_REMOTE_FREE
+        // 换了取块的TC时才重写各页的登记，同一个TC反复取块不用再写
+        if (owner != 0 && span->_ownerId != owner)
+        {
+            span->_ownerId = owner;
+            PageCache::getInstance()->SetSpanOwner(span, owner);
+        }
+#else
+        (void) owner;
+#endif
 
         return actualNum;
     }
 }
 
+void CentralCache::ReleaseRangeObj(void *const *ptrs, size_t n, size_t size)
+{
+    size_t index = SizeClass::Index(size);
+
+    // 传输缓存放得下，整段拷进去
+    {
+        TransferCache &tc = _transferCaches[index];
+        std::lock_guard<SpinLock> lg(tc.lock);
+        if (n <= tc.capacity - tc.count)
+        {
+            memcpy(tc.slots + tc.count, ptrs, n * sizeof(void *));
+            tc.count += n;
+            return;
+        }
+    }
+
+    // 传输缓存放不下，逐块还给所属的span
+    ReleaseListToSpans(ptrs, n, size);
+}
+
+size_t CentralCache::ReleaseTransferCaches()
+{
+    size_t bytes = 0;
+    void *objs[512]; // 不超过单批上限（NumMoveSize）
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        TransferCache &tc = _transferCaches[i];
+        size_t size = SizeClass::Size(i);
+        // 每次在自旋锁内拷出一段，解锁后再还给span，避免持有自旋锁去等桶锁和PC的锁
+        while (true)
+        {
+            size_t n;
+            {
+                std::lock_guard<SpinLock> lg(tc.lock);
+                n = std::min(tc.count, sizeof(objs) / sizeof(objs[0]));
+                tc.count -= n;
+                memcpy(objs, tc.slots + tc.count, n * sizeof(void *));
+            }
+            if (n == 0)
+                break;
+            ReleaseListToSpans(objs, n, size);
+            bytes += n * size;
+        }
+    }
+    return bytes;
+}
+
+void CentralCache::CollectStats(MemoryPoolStats &stats)
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        size_t transferObjs;
+        {
+            std::lock_guard<SpinLock> lg(_transferCaches[i].lock);
+            transferObjs = _transferCaches[i].count;
+        }
+        size_t objs = transferObjs + _spanFreeObjs[i];
+        stats.centralObjs[i] += objs;
+        stats.transferCacheBytes += transferObjs * SizeClass::Size(i);
+        stats.centralCacheBytes += objs * SizeClass::Size(i);
+    }
+}
+
 Span *CentralCache::getOneSpan(SpanList &list, size_t size)
 {
     // 1. 遍历自身
@@ -58,24 +155,15 @@ Span *CentralCache::getOneSpan(SpanList &list, size_t size)
     // 但是CC和TC之间的内存管理是以块为单位（size为块的字节数）
     // 而PC和CC之间是以Page为单位
     // 2.1 size和page的转换，按该size在CC的单次分配上限去算
-    size_t k = SizeClass::NumMovePage(size);
+    size_t k = SizeClass::ClassPages(SizeClass::Index(size));
 
-    // 需要注意，由于NewSpan内部存在递归
-    // 函数没出栈lock_guard不解锁，导致递归的函数不能进栈，会发生死锁
-    // 因此要在NewSpan外部去加锁
-    Span *span = nullptr;
-    {
-        std::lock_guard<std::mutex> lg(PageCache::getInstance()->_pageMtx);
-        span = PageCache::getInstance()->NewSpan(k);
-
-        assert(span);
-        assert(span->_pageId != 0);
-        // 注意，这个操作必须写在PC锁内，否则可能线程A刚申请了span。
-        // 另一半因为线程B释放span触发了PC的span合并，导致该span
-        // 既被分配给A又被PC管理
-        span->_isUse = true;
-        span->_objSize = size;
-    }
+    // NewSpan内部只锁所涉及的区域和桶，返回时span已经被标记为使用中
+    Span *span = PageCache::getInstance()->NewSpan(k);
+    assert(span);
+    assert(span->_pageId != 0);
+    span->_objSize = size;
+    // 登记每页的尺寸类，释放小对象时不必再访问span
+    PageCache::getInstance()->SetSpanClass(span, SizeClass::Index(size));
 
     // 2.2 按size划分连续内存空间
     char *start = (char *) (span->_pageId << PAGE_SHIFT); // start用char*，方便后续的+=操作
@@ -83,13 +171,17 @@ Span *CentralCache::getOneSpan(SpanList &list, size_t size)
 
     span->_freeList = start; // 移动到freeList
     void *tail = start; // 记录已经划分的区域末端
+    size_t count = 1; // 划分出的块数
 
     start += size;
-    while (start < end)
+    // 注意判断的是整块能否放下：span字节数不一定是size的整数倍，
+    // 只判断start < end会让最后一块越过span末尾
+    while (start + size <= end)
     {
         ObjNext(tail) = start; // 让tail指向start
         tail = start;
         start += size;
+        count++;
     }
     ObjNext(tail) = nullptr; // tail最后需指向null
 
@@ -97,6 +189,7 @@ Span *CentralCache::getOneSpan(SpanList &list, size_t size)
     // 要对桶操作了，把桶锁加回来
     list.mtx.lock();
     list.PushFront(span);
+    _spanFreeObjs[SizeClass::Index(size)] += count;
 
     // 4. 注意最后要返回这个span。
     // 因为要从这个span中截取一定的内存块给TC
@@ -109,7 +202,7 @@ Span *CentralCache::getOneSpan(SpanList &list, size_t size)
 // 该操作主要优化了桶锁和页锁的竞争，但仅在需要回收的span数量大于1的情况下
 // 但实际需要回收的span通常<=1，这种情况下页锁的竞争无论放在循环内外都只出现一次或不出现，
 // 其次桶锁本身竞争并不激烈， 因此整体的时间变化微乎其微。
-void CentralCache::ReleaseListToSpans(void *start, size_t size)
+void CentralCache::ReleaseListToSpans(void *const *ptrs, size_t n, size_t size)
 {
     size_t index = SizeClass::Index(size);
 
@@ -119,10 +212,11 @@ void CentralCache::ReleaseListToSpans(void *start, size_t size)
 
     {// 限制 CClg 的作用域，确保只在操作 _spanLists 时加锁
         std::unique_lock<std::mutex> CClg(_spanLists[index].mtx);
+        size_t returnedObjs = 0; // 随span还给PC的块数
 
-        while (start)
+        for (size_t i = 0; i < n; ++i)
         {
-            void* next = ObjNext(start);
+            void* start = ptrs[i];
             // 1. 找到对应span
             Span* span = PageCache::getInstance()->MapObjectToSpan(start);
 
@@ -136,6 +230,7 @@ void CentralCache::ReleaseListToSpans(void *start, size_t size)
             {
                 // 仅将其从 CentralCache 的双向链表中剔除
                 _spanLists[index].Erase(span);
+                returnedObjs += (span->_n << PAGE_SHIFT) / size;
                 span->_freeList = nullptr;
                 span->_next = nullptr;
                 span->_prev = nullptr;
@@ -143,15 +238,15 @@ void CentralCache::ReleaseListToSpans(void *start, size_t size)
                 // 将其收集到局部的 emptySpans 链表中，延迟向 PageCache 归还
                 emptySpans.PushFront(span);
             }
-            start = next;
         }
+        _spanFreeObjs[index] += n;
+        _spanFreeObjs[index] -= returnedObjs;
     } // 离开作用域，CClg 自动解锁！极大地缩短了 CC 桶锁的占用时间！
 
-    // 【核心优化2】在 CC 桶锁解开之后，统一去抢 PC 大锁，进行批量归还
+    // 【核心优化2】在 CC 桶锁解开之后，统一交还给 PageCache
+    // PC内部按区域加锁，不同区域的span归还互不阻塞
     if (!emptySpans.Empty())
     {
-        std::unique_lock<std::mutex> PClg(PageCache::getInstance()->_pageMtx);
-
         // 遍历局部的 emptySpans，一次性交还给 PageCache
         Span* it = emptySpans.Begin();
         while (it != emptySpans.End())
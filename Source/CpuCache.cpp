@@ -0,0 +1,510 @@
+#include "CpuCache.h"
+#include "CentralCache.h"
+#include <new>
+
+#if defined(__linux__)
+#include <sched.h>
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <cstddef>
+#define MEMORYPOOL_HAVE_RSEQ 1
+// ThreadSanitizer看不到内联汇编里的读写，会把经rseq临界区在线程之间传递的块误报为竞争，
+// 用TSan构建时只走带锁的路径
+#if defined(__SANITIZE_THREAD__)
+#define MEMORYPOOL_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define MEMORYPOOL_TSAN 1
+#endif
+#endif
+// rseq临界区目前只实现了x86-64，其它架构只用rseq读CPU号
+#if defined(__x86_64__) && !defined(MEMORYPOOL_TSAN)
+#define MEMORYPOOL_RSEQ_CS 1
+#endif
+#endif
+#endif
+#endif
+
+#if defined(MEMORYPOOL_RSEQ_CS)
+static_assert(offsetof(struct rseq, cpu_id) == 4, "unexpected struct rseq layout");
+static_assert(offsetof(struct rseq, rseq_cs) == 8, "unexpected struct rseq layout");
+
+#define MEMORYPOOL_STR_(x) #x
+#define MEMORYPOOL_STR(x) MEMORYPOOL_STR_(x)
+
+// 当前线程的rseq区域，由glibc在线程启动时注册
+static inline struct rseq *CurrentRseq()
+{
+    return (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * 两个临界区的结构相同：
+ *   3: 临界区描述符（起点1、提交点之后2、abort入口4），放在__rseq_cs段
+ *   0: 把描述符地址写进rseq_cs，声明进入临界区
+ *   1: 读cpu_id，算出当前CPU的栈长度和数组地址，检查空/满
+ *      最后一条指令写回栈的长度，即提交
+ *   2: 临界区结束。取空/压满/CPU号超出范围时直接跳到这里，结果为失败
+ *   4: abort入口，前面紧跟注册rseq时的签名；被抢占、迁移或收到信号时内核跳到这里，回到0重来
+ * 提交之前写的寄存器和栈顶之上的槽位都不会被别人看到，重来一次不会有副作用
+ */
+
+/**
+ * 从当前CPU的栈弹出一个块
+ * @param countBase 0号CPU的栈长度地址
+ * @param slotBase 0号CPU的指针数组地址
+ * @param stride 每个CPU的字节数
+ * @param numCpus CPU数，cpu_id不小于它（未注册rseq等）时失败
+ * @return 块指针，栈为空时返回nullptr
+ */
+static inline void *RseqPop(char *countBase, char *slotBase, size_t stride, size_t numCpus)
+{
+    void *obj;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"
+        "1:\n\t"
+        "xorl %k[obj], %k[obj]\n\t"
+        "movl 4(%[rs]), %%eax\n\t"
+        "cmpq %[numCpus], %%rax\n\t"
+        "jae 2f\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "movq (%[countBase], %%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 2f\n\t"
+        "subq $1, %%rcx\n\t"
+        "leaq (%[slotBase], %%rax), %%rdx\n\t"
+        "movq (%%rdx, %%rcx, 8), %[obj]\n\t"
+        "movq %%rcx, (%[countBase], %%rax)\n\t"
+        "2:\n\t"
+        "jmp 5f\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " MEMORYPOOL_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        "5:\n\t"
+        : [obj] "=&r"(obj)
+        : [rs] "r"(CurrentRseq()), [countBase] "r"(countBase), [slotBase] "r"(slotBase),
+          [stride] "r"(stride), [numCpus] "r"(numCpus)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return obj;
+}
+
+/**
+ * 把块压入当前CPU的栈
+ * @param capacity 栈的容量
+ * @return 栈已满时返回false
+ * 其余参数同RseqPop
+ */
+static inline bool RseqPush(void *obj, char *countBase, char *slotBase, size_t stride, size_t numCpus,
+                            size_t capacity)
+{
+    size_t ok;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"
+        "1:\n\t"
+        "xorl %k[ok], %k[ok]\n\t"
+        "movl 4(%[rs]), %%eax\n\t"
+        "cmpq %[numCpus], %%rax\n\t"
+        "jae 2f\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "movq (%[countBase], %%rax), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae 2f\n\t"
+        "leaq (%[slotBase], %%rax), %%rdx\n\t"
+        "movq %[obj], (%%rdx, %%rcx, 8)\n\t"
+        "addq $1, %%rcx\n\t"
+        "movl $1, %k[ok]\n\t"
+        "movq %%rcx, (%[countBase], %%rax)\n\t"
+        "2:\n\t"
+        "jmp 5f\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " MEMORYPOOL_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        "5:\n\t"
+        : [ok] "=&r"(ok)
+        : [rs] "r"(CurrentRseq()), [obj] "r"(obj), [countBase] "r"(countBase), [slotBase] "r"(slotBase),
+          [stride] "r"(stride), [numCpus] "r"(numCpus), [capacity] "r"(capacity)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return ok != 0;
+}
+#endif
+
+CpuCache::CpuCache()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = (long) info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+    _numCpus = n > 0 ? (size_t) n : 1;
+
+    // 槽位数组不能用new：前端本身就是分配器，这里直接向系统按页申请
+    size_t bytes = _numCpus * sizeof(Slot);
+    size_t kpage = (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    _slots = (Slot *) SystemAlloc(kpage);
+    for (size_t i = 0; i < _numCpus; ++i)
+    {
+        new(&_slots[i]) Slot;
+    }
+
+#if defined(MEMORYPOOL_RSEQ_CS)
+    // glibc没有注册rseq（版本太旧、内核不支持或被glibc.pthread.rseq=0关闭）时只用慢路径
+    if (__rseq_size > 0)
+    {
+        // 每个CPU：各桶栈的长度，之后是各桶的指针数组，按页取整
+        // 栈的容量为一批，但不超过CPU_CACHE_FAST_BYTES：大块的一批能有几百KB，每个CPU都攒满就是几十MB。
+        // 块比CPU_CACHE_FAST_BYTES还大的桶容量为0，不走快路径，直接用槽位
+        size_t offset = FREE_LIST_NUM * sizeof(size_t);
+        for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        {
+            _fastOffset[i] = offset;
+            _fastCapacity[i] = std::min(SizeClass::ClassBatch(i), CPU_CACHE_FAST_BYTES / SizeClass::Size(i));
+            offset += _fastCapacity[i] * sizeof(void *);
+        }
+        size_t stridePages = (offset + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        _fastStride = stridePages << PAGE_SHIFT;
+        _fast = (char *) SystemAlloc(stridePages * _numCpus);
+        _useRseq = true;
+    }
+#endif
+}
+
+size_t CpuCache::CurrentCpu()
+{
+    int cpu = -1;
+
+#if defined(MEMORYPOOL_HAVE_RSEQ)
+    // glibc 2.35+ 会为每个线程注册rseq，内核在线程被调度时更新cpu_id，读它只需一次访存
+    if (__rseq_size > 0)
+    {
+        const struct rseq *rs = (const struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+        cpu = (int) rs->cpu_id;
+    }
+#endif
+
+#if defined(__linux__)
+    if (cpu < 0)
+    {
+        cpu = sched_getcpu();
+    }
+#elif defined(_WIN32)
+    cpu = (int) GetCurrentProcessorNumber();
+#endif
+
+    // 获取失败时所有线程共用0号槽位，退化为一个带锁的全局缓存
+    if (cpu < 0)
+    {
+        cpu = 0;
+    }
+    return (size_t) cpu % _numCpus;
+}
+
+void *CpuCache::Allocate(size_t size)
+{
+    size_t index = SizeClass::Index(size);
+#if defined(MEMORYPOOL_RSEQ_CS)
+    if (_useRseq && _fastCapacity[index] > 0)
+    {
+        void *obj = RseqPop(_fast + index * sizeof(size_t), _fast + _fastOffset[index], _fastStride, _numCpus);
+        if (obj != nullptr)
+        {
+            return obj;
+        }
+        return Refill(index);
+    }
+#endif
+
+    Slot &slot = _slots[CurrentCpu()];
+    size_t batchNum;
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        void *obj = slot.cache.TryAllocate(index);
+        if (obj != nullptr)
+        {
+            return obj;
+        }
+        batchNum = slot.cache.BeginFetch(index);
+    }
+
+    // 向CC取块时不持有槽位的锁：CC/PC可能要等桶锁甚至向系统申请内存，同一CPU上的其它线程不必陪着等
+    void *objs[512]; // 不超过单批上限（NumMoveSize）
+    size_t n = CentralCache::getInstance()->FetchRangeObj(objs, batchNum, SizeClass::Size(index));
+    std::lock_guard<SpinLock> lg(slot.lock);
+    return slot.cache.EndFetch(index, objs, n);
+}
+
+void CpuCache::Deallocate(void *obj, size_t size)
+{
+    DeallocateByIndex(obj, SizeClass::Index(size));
+}
+
+void CpuCache::DeallocateByIndex(void *obj, size_t index)
+{
+#if defined(MEMORYPOOL_RSEQ_CS)
+    if (_useRseq && _fastCapacity[index] > 0)
+    {
+        if (!RseqPush(obj, _fast + index * sizeof(size_t), _fast + _fastOffset[index], _fastStride, _numCpus,
+                      _fastCapacity[index]))
+        {
+            Spill(obj, index);
+        }
+        return;
+    }
+#endif
+
+    Slot &slot = _slots[CurrentCpu()];
+    std::lock_guard<SpinLock> lg(slot.lock);
+    slot.cache.DeallocateByIndex(obj, index);
+}
+
+void CpuCache::AllocateBatch(size_t size, void **ptrs, size_t n)
+{
+    // 批量接口本身已经摊薄了加锁的开销，直接走槽位：先拷走槽位中缓存的块，
+    // 不够的部分解锁后直接向CC要，写进调用方的数组
+    size_t index = SizeClass::Index(size);
+    Slot &slot = _slots[CurrentCpu()];
+    size_t filled;
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        filled = slot.cache.TakeCached(index, ptrs, n);
+    }
+    if (filled == n)
+        return;
+
+    size_t taken = filled;
+    size_t fetches = 0;
+    while (filled < n)
+    {
+        filled += CentralCache::getInstance()->FetchRangeObj(ptrs + filled, n - filled, SizeClass::Size(index));
+        ++fetches;
+    }
+    std::lock_guard<SpinLock> lg(slot.lock);
+    slot.cache.CountFetch(index, n - taken, fetches);
+}
+
+void CpuCache::DeallocateBatch(void **ptrs, size_t n, size_t index)
+{
+    Slot &slot = _slots[CurrentCpu()];
+    std::lock_guard<SpinLock> lg(slot.lock);
+    slot.cache.DeallocateBatch(ptrs, n, index);
+}
+
+void *CpuCache::Refill(size_t index)
+{
+    void *objs[512]; // 不超过单批上限（NumMoveSize）
+    size_t n = (_fastCapacity[index] + 1) / 2;
+    Slot &slot = _slots[CurrentCpu()];
+    size_t got;
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        got = slot.cache.TakeCached(index, objs, n);
+    }
+
+    // 槽位也空了才向CC取，这时不持有槽位的锁
+    bool fetched = (got == 0);
+    if (fetched)
+    {
+        got = CentralCache::getInstance()->FetchRangeObj(objs, n, SizeClass::Size(index));
+    }
+
+    size_t i = 1;
+#if defined(MEMORYPOOL_RSEQ_CS)
+    // 第一个直接返回，其余压入当前CPU的栈。期间线程可能被迁移到栈已满的CPU，压不进去的还给槽位
+    while (i < got && RseqPush(objs[i], _fast + index * sizeof(size_t), _fast + _fastOffset[index], _fastStride,
+                               _numCpus, _fastCapacity[index]))
+    {
+        ++i;
+    }
+#endif
+    if (fetched || i < got)
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        if (fetched)
+            slot.cache.CountFetch(index, got, 1);
+        if (i < got)
+            slot.cache.DeallocateBatch(objs + i, got - i, index);
+    }
+    Maintain(slot);
+    return objs[0];
+}
+
+void CpuCache::Spill(void *obj, size_t index)
+{
+    void *objs[512];
+    size_t n = 0;
+    objs[n++] = obj;
+
+#if defined(MEMORYPOOL_RSEQ_CS)
+    // 栈中留下一半，之后的释放又能走快路径
+    size_t half = _fastCapacity[index] / 2;
+    while (n <= half)
+    {
+        void *p = RseqPop(_fast + index * sizeof(size_t), _fast + _fastOffset[index], _fastStride, _numCpus);
+        if (p == nullptr)
+            break;
+        objs[n++] = p;
+    }
+#endif
+
+    Slot &slot = _slots[CurrentCpu()];
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        slot.cache.DeallocateBatch(objs, n, index);
+    }
+    Maintain(slot);
+}
+
+void CpuCache::Maintain(Slot &slot)
+{
+#if defined(MEMORYPOOL_RSEQ_CS)
+    // 每次都检查要加锁、读时钟、扫一遍各桶，对块较大、容量只有几个的桶太贵。
+    // 两次检查之间最多补充CPU_CACHE_CHECK_INTERVAL次，超出预算的量有限
+    size_t ops = slot.slowOps.load(std::memory_order_relaxed) + 1;
+    slot.slowOps.store(ops, std::memory_order_relaxed);
+    if (ops % CPU_CACHE_CHECK_INTERVAL != 0)
+        return;
+
+    // 当前CPU各桶栈中的字节数。其它线程被调度到这个CPU上时也在改，读到的是近似值
+    const size_t *counts = (const size_t *) (_fast + CurrentCpu() * _fastStride);
+    size_t fastBytes = 0;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        fastBytes += __atomic_load_n(&counts[i], __ATOMIC_RELAXED) * SizeClass::Size(i);
+    }
+
+    bool drain;
+    {
+        std::lock_guard<SpinLock> lg(slot.lock);
+        drain = slot.cache.ReleaseDue() || !slot.cache.ChargeExtra(fastBytes);
+    }
+    if (drain)
+    {
+        // 倒回槽位后，超出预算的部分由槽位收缩；整个周期没用到的块按槽位的低水位逐步还给CC
+        DrainCurrentCpu();
+        std::lock_guard<SpinLock> lg(slot.lock);
+        slot.cache.ReleaseIdle();
+    }
+#else
+    (void) slot;
+#endif
+}
+
+size_t CpuCache::DrainCurrentCpu()
+{
+    size_t bytes = 0;
+#if defined(MEMORYPOOL_RSEQ_CS)
+    if (!_useRseq)
+        return 0;
+
+    void *objs[512];
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        while (true)
+        {
+            size_t n = 0;
+            while (n < _fastCapacity[i])
+            {
+                void *p = RseqPop(_fast + i * sizeof(size_t), _fast + _fastOffset[i], _fastStride, _numCpus);
+                if (p == nullptr)
+                    break;
+                objs[n++] = p;
+            }
+            if (n == 0)
+                break;
+
+            Slot &slot = _slots[CurrentCpu()];
+            std::lock_guard<SpinLock> lg(slot.lock);
+            slot.cache.DeallocateBatch(objs, n, i);
+            bytes += n * SizeClass::Size(i);
+        }
+    }
+#endif
+    return bytes;
+}
+
+size_t CpuCache::Flush(bool all)
+{
+    if (!all)
+    {
+        // 快路径的栈只能由所在CPU上的线程操作：先把当前CPU的栈倒进槽位，再清空槽位
+        DrainCurrentCpu();
+        Slot &slot = _slots[CurrentCpu()];
+        std::lock_guard<SpinLock> lg(slot.lock);
+        return slot.cache.Flush();
+    }
+
+#if defined(MEMORYPOOL_RSEQ_CS)
+    // 逐个把自己绑到每个CPU上，在那里倒空它的栈；绑不上的CPU（不在允许的集合中）跳过，
+    // 它的栈留到之后在那里运行的线程取用。最后恢复原来的CPU亲和性
+    cpu_set_t oldSet;
+    bool pinned = _useRseq && sched_getaffinity(0, sizeof(oldSet), &oldSet) == 0;
+#endif
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < _numCpus; ++i)
+    {
+#if defined(MEMORYPOOL_RSEQ_CS)
+        if (pinned && i < CPU_SETSIZE)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) == 0)
+            {
+                DrainCurrentCpu();
+            }
+        }
+#endif
+        std::lock_guard<SpinLock> lg(_slots[i].lock);
+        bytes += _slots[i].cache.Flush();
+    }
+
+#if defined(MEMORYPOOL_RSEQ_CS)
+    if (pinned)
+    {
+        sched_setaffinity(0, sizeof(oldSet), &oldSet);
+    }
+#endif
+    return bytes;
+}
+
+void CpuCache::CollectStats(MemoryPoolStats &stats)
+{
+#if defined(MEMORYPOOL_RSEQ_CS)
+    if (!_useRseq)
+        return;
+
+    for (size_t cpu = 0; cpu < _numCpus; ++cpu)
+    {
+        const size_t *counts = (const size_t *) (_fast + cpu * _fastStride);
+        for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        {
+            // 其它CPU上的线程随时在改，只做一次不撕裂的读
+            size_t n = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+            stats.threadCacheBytes += n * SizeClass::Size(i);
+        }
+    }
+#else
+    (void) stats;
+#endif
+}
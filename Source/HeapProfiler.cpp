@@ -0,0 +1,330 @@
+#include "HeapProfiler.h"
+#include "PageCache.h"
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unwind.h>
+#endif
+
+// 停止采样时的复查间隔：倒计数设成这么大，重新开启采样后最迟在申请这么多字节后生效
+static const int64_t PROFILE_RECHECK_BYTES = (int64_t) 64 << 20;
+
+// 按均值为rate的指数分布选取下一次采样前要申请的字节数
+static int64_t NextSampleBytes(uint64_t &rng, size_t rate)
+{
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    uint64_t r = rng * 2685821657736338717ULL;
+
+    // 取高53位作为(0, 1]上的均匀分布
+    double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (int64_t) (-std::log(u) * (double) rate) + 1;
+}
+
+bool HeapProfiler::PickNextSample()
+{
+    int64_t &countdown = Countdown();
+    ThreadState &state = State();
+    size_t rate = getInstance()->SampleRate();
+
+    if (rate == 0)
+    {
+        countdown = PROFILE_RECHECK_BYTES;
+        return false;
+    }
+
+    bool first = (state.rng == 0);
+    if (first)
+    {
+        // 用线程局部变量的地址和时间做种子，各线程的采样点互不相关
+        state.rng = (uint64_t) (uintptr_t) &state ^
+                    (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+        if (state.rng == 0)
+            state.rng = 1;
+    }
+    countdown = NextSampleBytes(state.rng, rate);
+
+    // 线程的第一次计数只是初始化倒计数；采样过程中的申请不再采样，避免递归
+    return !first && !state.busy;
+}
+
+// 抓取当前调用栈，skip为跳过的栈帧数（分析器自己的函数）
+#ifdef _WIN32
+static size_t CaptureStack(void **pcs, size_t max, size_t skip)
+{
+    return RtlCaptureStackBackTrace((DWORD) skip + 1, (DWORD) max, pcs, nullptr);
+}
+#else
+struct UnwindState
+{
+    void **pcs;
+    size_t depth;
+    size_t max;
+    size_t skip;
+};
+
+static _Unwind_Reason_Code UnwindCallback(struct _Unwind_Context *ctx, void *arg)
+{
+    UnwindState *state = (UnwindState *) arg;
+    uintptr_t ip = _Unwind_GetIP(ctx);
+    if (ip == 0)
+        return _URC_END_OF_STACK;
+    if (state->skip > 0)
+    {
+        state->skip--;
+        return _URC_NO_REASON;
+    }
+    state->pcs[state->depth++] = (void *) ip;
+    return state->depth < state->max ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+// 直接用libgcc的展开器，不用glibc的backtrace：后者第一次调用时会dlopen libgcc_s，其中会申请内存
+// 不能内联，否则跳过的栈帧数就不对了
+__attribute__((noinline)) static size_t CaptureStack(void **pcs, size_t max, size_t skip)
+{
+    UnwindState state = {pcs, 0, max, skip + 1};
+    _Unwind_Backtrace(UnwindCallback, &state);
+    return state.depth;
+}
+#endif
+
+void *HeapProfiler::SampledAlloc(size_t size)
+{
+    // 抓调用栈和分配span的过程中如果再申请内存，不再采样
+    struct BusyGuard
+    {
+        ThreadState &state;
+        explicit BusyGuard(ThreadState &s) : state(s) { state.busy = true; }
+        ~BusyGuard() { state.busy = false; }
+    } guard(State());
+
+    void *pcs[PROFILE_MAX_DEPTH];
+    size_t depth = CaptureStack(pcs, PROFILE_MAX_DEPTH, 1);
+
+    // 单独占用一个span：小对象按块大小向上取整到页，大对象与ConcurrentAlloc相同
+    Span *span = nullptr;
+    if (size > MAX_BYTES)
+    {
+        size_t k = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+        span = k >= PAGE_NUM ? PageCache::getInstance()->NewHugeSpan(k) : PageCache::getInstance()->NewSpan(k);
+        span->_objSize = size;
+    } else
+    {
+        size_t alignSize = SizeClass::RoundUp(size);
+        size_t k = (alignSize + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        span = PageCache::getInstance()->NewSpan(k);
+        // 可用大小仍按块大小计算；释放时页的尺寸类为0，会走span的路径
+        span->_objSize = alignSize;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(_mtx);
+        StackEntry *entry = FindOrInsert(pcs, depth);
+        entry->liveObjs++;
+        entry->liveBytes += size;
+        entry->allocObjs++;
+        entry->allocBytes += size;
+        span->_sample = entry;
+        span->_sampleBytes = size;
+    }
+    return (void *) (span->_pageId << PAGE_SHIFT);
+}
+
+void HeapProfiler::RecordFree(Span *span)
+{
+    std::lock_guard<std::mutex> lg(_mtx);
+    StackEntry *entry = (StackEntry *) span->_sample;
+    entry->liveObjs--;
+    entry->liveBytes -= span->_sampleBytes;
+    span->_sample = nullptr;
+    span->_sampleBytes = 0;
+}
+
+HeapProfiler::StackEntry *HeapProfiler::FindOrInsert(void *const *pcs, size_t depth)
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        hash ^= (size_t) pcs[i];
+        hash *= 1099511628211ULL;
+    }
+
+    StackEntry *&head = _table[hash % HASH_SIZE];
+    for (StackEntry *it = head; it != nullptr; it = it->next)
+    {
+        if (it->hash == hash && it->depth == depth && memcmp(it->pcs, pcs, depth * sizeof(void *)) == 0)
+            return it;
+    }
+
+    // 记录来自定长内存池（直接向系统申请），不会回到分配器自身
+    StackEntry *entry = _entryPool.New();
+    entry->hash = hash;
+    entry->depth = depth;
+    memcpy(entry->pcs, pcs, depth * sizeof(void *));
+    entry->next = head;
+    head = entry;
+    return entry;
+}
+
+namespace
+{
+    // 带缓冲的文件输出，只用栈上的缓冲区和系统调用：
+    // 输出时持有分析器的锁，不能经过会申请内存的stdio
+    class ProfileWriter
+    {
+    public:
+        explicit ProfileWriter(int fd) : _fd(fd)
+        {
+        }
+
+        ~ProfileWriter()
+        {
+            Flush();
+        }
+
+        void Printf(const char *fmt, ...)
+        {
+            char line[256];
+            va_list args;
+            va_start(args, fmt);
+            int n = vsnprintf(line, sizeof(line), fmt, args);
+            va_end(args);
+            if (n > 0)
+                Write(line, (size_t) n < sizeof(line) ? (size_t) n : sizeof(line) - 1);
+        }
+
+        void Write(const char *data, size_t n)
+        {
+            if (_len + n > sizeof(_buf))
+                Flush();
+            if (n > sizeof(_buf))
+            {
+                RawWrite(data, n);
+                return;
+            }
+            memcpy(_buf + _len, data, n);
+            _len += n;
+        }
+
+        bool Ok() const
+        {
+            return _ok;
+        }
+
+        void Flush()
+        {
+            RawWrite(_buf, _len);
+            _len = 0;
+        }
+
+    private:
+        void RawWrite(const char *data, size_t n)
+        {
+            while (n > 0)
+            {
+#ifdef _WIN32
+                int w = _write(_fd, data, (unsigned) n);
+#else
+                ssize_t w = write(_fd, data, n);
+#endif
+                if (w <= 0)
+                {
+                    _ok = false;
+                    return;
+                }
+                data += w;
+                n -= (size_t) w;
+            }
+        }
+
+        int _fd;
+        char _buf[4096];
+        size_t _len = 0;
+        bool _ok = true;
+    };
+}
+
+bool HeapProfiler::WriteProfile(const char *path, bool liveOnly)
+{
+#ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0)
+        return false;
+
+    bool ok;
+    {
+        ProfileWriter out(fd);
+        {
+            std::lock_guard<std::mutex> lg(_mtx);
+
+            size_t liveObjs = 0, liveBytes = 0, allocObjs = 0, allocBytes = 0;
+            for (size_t i = 0; i < HASH_SIZE; ++i)
+            {
+                for (StackEntry *it = _table[i]; it != nullptr; it = it->next)
+                {
+                    if (liveOnly && it->liveObjs == 0)
+                        continue;
+                    liveObjs += it->liveObjs;
+                    liveBytes += it->liveBytes;
+                    allocObjs += it->allocObjs;
+                    allocBytes += it->allocBytes;
+                }
+            }
+            out.Printf("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                       liveObjs, liveBytes, allocObjs, allocBytes, SampleRate());
+
+            for (size_t i = 0; i < HASH_SIZE; ++i)
+            {
+                for (StackEntry *it = _table[i]; it != nullptr; it = it->next)
+                {
+                    if (liveOnly && it->liveObjs == 0)
+                        continue;
+                    out.Printf("%zu: %zu [%zu: %zu] @", it->liveObjs, it->liveBytes, it->allocObjs, it->allocBytes);
+                    for (size_t d = 0; d < it->depth; ++d)
+                    {
+                        out.Printf(" %p", it->pcs[d]);
+                    }
+                    out.Write("\n", 1);
+                }
+            }
+        }
+
+#ifdef __linux__
+        // pprof按这里的映射把地址对应到各个可执行文件和动态库
+        out.Printf("\nMAPPED_LIBRARIES:\n");
+        int maps = open("/proc/self/maps", O_RDONLY);
+        if (maps >= 0)
+        {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(maps, buf, sizeof(buf))) > 0)
+            {
+                out.Write(buf, (size_t) n);
+            }
+            close(maps);
+        }
+#endif
+        out.Flush();
+        ok = out.Ok();
+    }
+
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+    return ok;
+}
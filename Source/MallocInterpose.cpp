@@ -0,0 +1,306 @@
+// libmemorypool.so：用本项目的分配器接管 malloc/free/new/delete
+// 用法：LD_PRELOAD=./libmemorypool.so ./your_program
+// 不需要改动任何代码，就能和glibc的malloc直接对比
+//
+// 注意：本文件必须以 -fno-builtin 编译，否则编译器可能把 malloc+memset 优化成 calloc，
+// 在calloc的实现里就会变成无限递归
+
+#include "ConcurrentAlloc.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__GNUC__)
+#define MEMORYPOOL_EXPORT extern "C" __attribute__((visibility("default")))
+#else
+#define MEMORYPOOL_EXPORT extern "C"
+#endif
+
+namespace
+{
+    // 申请失败时malloc系列返回nullptr并设置errno，而不是抛异常
+    void *TryAlloc(size_t size)
+    {
+        try
+        {
+            return ConcurrentAlloc(size);
+        } catch (const std::bad_alloc &)
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+    }
+
+    bool IsPowerOfTwo(size_t n)
+    {
+        return n != 0 && (n & (n - 1)) == 0;
+    }
+
+    // 按对齐要求申请内存，具体策略见ConcurrentAllocAligned
+    void *AlignedAlloc(size_t align, size_t size)
+    {
+        try
+        {
+            return ConcurrentAllocAligned(size, align);
+        } catch (const std::bad_alloc &)
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+    }
+}
+
+MEMORYPOOL_EXPORT void *malloc(size_t size)
+{
+    return TryAlloc(size);
+}
+
+// 地址空间预留模式下判断指针归属只需一次区间比较，
+// 不是本分配器的指针（例如接管之前由其它分配器申请的）直接忽略，而不是去查映射表
+static inline bool IsForeign(void *ptr)
+{
+#ifdef MEMORYPOOL_ARENA
+    return !ConcurrentIsOwned(ptr);
+#else
+    (void) ptr;
+    return false;
+#endif
+}
+
+MEMORYPOOL_EXPORT void free(void *ptr)
+{
+    if (ptr && !IsForeign(ptr))
+    {
+        ConcurrentFree(ptr);
+    }
+}
+
+MEMORYPOOL_EXPORT void *calloc(size_t n, size_t size)
+{
+    size_t total = n * size;
+    if (size != 0 && total / size != n)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // 内存块会被复用，不能假定是0
+    void *ptr = TryAlloc(total);
+    if (ptr)
+    {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+MEMORYPOOL_EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == nullptr)
+    {
+        return TryAlloc(size);
+    }
+    if (IsForeign(ptr))
+    {
+        // 不是本分配器的块，无从得知它的大小，没法安全地搬移内容。
+        // 按申请失败处理：原内存保持不变，调用方仍持有它
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (size == 0)
+    {
+        ConcurrentFree(ptr);
+        return nullptr;
+    }
+
+    try
+    {
+        return ConcurrentRealloc(ptr, size);
+    } catch (const std::bad_alloc &)
+    {
+        // 申请失败时原内存保持不变
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+MEMORYPOOL_EXPORT void *memalign(size_t align, size_t size)
+{
+    if (!IsPowerOfTwo(align))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return AlignedAlloc(align, size);
+}
+
+MEMORYPOOL_EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (!IsPowerOfTwo(align) || align % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+    void *ptr = AlignedAlloc(align, size);
+    if (ptr == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+MEMORYPOOL_EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+MEMORYPOOL_EXPORT void *valloc(size_t size)
+{
+    return AlignedAlloc(1 << PAGE_SHIFT, size);
+}
+
+MEMORYPOOL_EXPORT void *pvalloc(size_t size)
+{
+    return AlignedAlloc(1 << PAGE_SHIFT, SizeClass::_RoundUp(size, 1 << PAGE_SHIFT));
+}
+
+MEMORYPOOL_EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return ptr && !IsForeign(ptr) ? ConcurrentUsableSize(ptr) : 0;
+}
+
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+// glibc的mallinfo2：用本分配器的统计快照填充，已有的监控代码不用修改
+MEMORYPOOL_EXPORT struct mallinfo2 mallinfo2()
+{
+    MemoryPoolStats stats = ConcurrentGetStats();
+    struct mallinfo2 info;
+    memset(&info, 0, sizeof(info));
+    info.arena = stats.mappedBytes; // 向系统申请的全部字节数
+    info.uordblks = stats.inUseBytes; // 应用程序持有的字节数
+    info.fordblks = stats.threadCacheBytes + stats.centralCacheBytes + stats.pageCacheFreeBytes; // 各层缓存的空闲字节数
+    info.fsmblks = stats.threadCacheBytes + stats.centralCacheBytes; // 小对象缓存中的空闲字节数
+    info.keepcost = stats.pageCacheFreeBytes; // 可以通过ConcurrentReleaseFreeMemory归还的字节数
+    return info;
+}
+#endif
+
+// ======================= operator new / delete =======================
+
+void *operator new(size_t size)
+{
+    return ConcurrentAlloc(size);
+}
+
+void *operator new[](size_t size)
+{
+    return ConcurrentAlloc(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return TryAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return TryAlloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+// 带大小的delete直接走不查基数树的释放路径，外来的指针和free一样忽略
+void operator delete(void *ptr, size_t size) noexcept
+{
+    if (ptr && !IsForeign(ptr))
+    {
+        ConcurrentFree(ptr, size);
+    }
+}
+
+void operator delete[](void *ptr, size_t size) noexcept
+{
+    if (ptr && !IsForeign(ptr))
+    {
+        ConcurrentFree(ptr, size);
+    }
+}
+
+#if defined(__cpp_aligned_new)
+void *operator new(size_t size, std::align_val_t align)
+{
+    void *ptr = AlignedAlloc((size_t) align, size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return AlignedAlloc((size_t) align, size);
+}
+
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return AlignedAlloc((size_t) align, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    // 对齐申请时size被放大过，这里不能按传入的size走带大小的释放
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+#endif
@@ -2,77 +2,336 @@
 // Created by CAO on 2026/2/15.
 //
 #include "PageCache.h"
+#include <thread>
+
+// 当前时间（毫秒），只用于比较span空闲了多久
+static size_t NowMs()
+{
+    return (size_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PageCache::PushSpan(Span *span, bool back)
+{
+    {
+        std::lock_guard<std::mutex> lg(_spanLists[span->_n].mtx);
+        if (back)
+            _spanLists[span->_n].Insert(_spanLists[span->_n].End(), span);
+        else
+            _spanLists[span->_n].PushFront(span);
+        MarkBucket(span->_n);
+    }
+    if (span->_isReturned)
+        _returnedPages += span->_n;
+    else
+        _freePages += span->_n;
+}
+
+void PageCache::RemoveSpan(Span *span)
+{
+    {
+        std::lock_guard<std::mutex> lg(_spanLists[span->_n].mtx);
+        _spanLists[span->_n].Erase(span);
+        MarkBucket(span->_n);
+    }
+    if (span->_isReturned)
+        _returnedPages -= span->_n;
+    else
+        _freePages -= span->_n;
+}
+
+void PageCache::CommitSpan(Span *span)
+{
+    if (span->_isReturned)
+    {
+        SystemCommit((void *) (span->_pageId << PAGE_SHIFT), span->_n);
+        span->_isReturned = false;
+    }
+}
+
+Span *PageCache::NewSpanObject()
+{
+    std::lock_guard<std::mutex> lg(_spanPoolMtx);
+    return _spanPool.New();
+}
+
+void PageCache::DeleteSpanObject(Span *span)
+{
+    std::lock_guard<std::mutex> lg(_spanPoolMtx);
+    _spanPool.Delete(span);
+}
+
+
+Span *PageCache::PopSpanLocked(size_t i, bool &contended, bool committedOnly)
+{
+    SpanList &list = _spanLists[i];
+    std::lock_guard<std::mutex> lg(list.mtx);
+
+    for (Span *it = list.Begin(); it != list.End(); it = it->_next)
+    {
+        // 桶中span的归还状态只在挂入之前改变，持有桶锁就能读
+        if (committedOnly && it->_isReturned)
+            continue;
+
+        // 正常顺序是先区域锁再桶锁，这里已经持有桶锁，只能尝试加锁
+        std::mutex &regionMtx = RegionMtx(it->_pageId);
+        if (regionMtx.try_lock())
+        {
+            // 拿到区域锁后该span就不会再被合并，直接从桶中取下
+            list.Erase(it);
+            MarkBucket(i);
+            if (it->_isReturned)
+                _returnedPages -= it->_n;
+            else
+                _freePages -= it->_n;
+            return it;
+        }
+        contended = true;
+    }
+    return nullptr;
+}
+
+
+Span *PageCache::CarveSpan(Span *span, size_t k)
+{
+    assert(span->_n >= k);
+
+    Span *kSpan = span;
+    if (span->_n > k)
+    {
+        // 分裂产生一个新的Span，该Span节点的空间需要新建立而不是用管理的空间
+        kSpan = NewSpanObject();
+        kSpan->_pageId = span->_pageId;
+        kSpan->_n = k;
+        kSpan->_isReturned = span->_isReturned;
+        span->_pageId += k; // span的pageId后移K
+        span->_n -= k;
+        // 在n-k桶插入，返回另一个
+        // 记录span的地址与页号的映射关系
+        // 在PC中，只需要记录第一页和最后一页的映射即可
+        _idSpanMap.set(span->_pageId, span);
+        _idSpanMap.set(span->_pageId + span->_n - 1, span);
+        PushSpan(span);
+    }
+
+    CommitSpan(kSpan); // 只提交分出去的k页，剩下的部分保持已归还状态，做到按需提交
+    // 注意，这个操作必须在区域锁内，否则可能线程A刚拿到span，
+    // 另一个线程因为释放相邻span触发了合并，导致该span既被分配给A又被PC管理
+    kSpan->_isUse = true;
+
+    // 记录【分配出去】的span地址与页号的映射关系
+    for (size_t i = 0; i < kSpan->_n; i++)
+    {
+        _idSpanMap.set(kSpan->_pageId + i, kSpan);
+    }
+    assert(kSpan->_pageId != 0);
+    return kSpan;
+}
+
+
+Span *PageCache::NewRegionSpan(size_t k, size_t alignPages)
+{
+    // 先从大块空闲集合中切一个满足对齐要求的区域，切不出来才向系统申请
+    Span *bigSpan = TakeLargeSpan(REGION_PAGES, alignPages > REGION_PAGES ? alignPages : REGION_PAGES);
+    if (bigSpan == nullptr)
+    {
+        bigSpan = GrowHeap(REGION_PAGES, alignPages);
+    }
+
+    std::lock_guard<std::mutex> lg(RegionMtx(bigSpan->_pageId));
+    return CarveSpan(bigSpan, k);
+}
+
+
+Span *PageCache::GrowHeap(size_t npages, size_t alignPages)
+{
+    assert(npages % REGION_PAGES == 0);
+
+    // 本次申请的页数：至少npages，并按增长策略放大；开启透明大页时再按2MB取整
+    bool hugePages = _hugePages;
+    size_t unitPages = hugePages ? (HUGE_PAGE_BYTES >> PAGE_SHIFT) : REGION_PAGES;
+    size_t growPages = _growPages;
+    size_t chunk = npages > growPages ? npages : growPages;
+    chunk = (chunk + unitPages - 1) / unitPages * unitPages;
+
+    if (alignPages < unitPages)
+        alignPages = unitPages;
+
+    // 系统调用放在任何锁之外；首地址至少按一个区域对齐，保证切出来的都是完整的区域
+    void *ptr = nullptr;
+#ifdef MEMORYPOOL_ARENA
+    // 地址空间预留模式：从预留区中切，不再调用mmap
+    size_t skipped = 0;
+    try
+    {
+        ptr = _arena.Alloc(chunk, alignPages, skipped);
+    } catch (const std::bad_alloc &)
+    {
+        // 预留区剩余不多时退回到只申请本次需要的部分
+        if (chunk == npages)
+            throw;
+        chunk = npages;
+        ptr = _arena.Alloc(chunk, alignPages, skipped);
+    }
+    _mappedPages += skipped;
+    if (skipped > 0)
+    {
+        // 为对齐跳过的页由完整的区域组成，同样按已归还的状态放进大块空闲集合
+        Span *gap = NewSpanObject();
+        gap->_pageId = ((size_t) ptr >> PAGE_SHIFT) - skipped;
+        gap->_n = skipped;
+        gap->_isReturned = true;
+        InsertLargeSpan(gap);
+    }
+#else
+    try
+    {
+        ptr = SystemAllocAligned(chunk, alignPages);
+    } catch (const std::bad_alloc &)
+    {
+        // 地址空间紧张时退回到只申请本次需要的部分
+        if (chunk == npages)
+            throw;
+        chunk = npages;
+        ptr = SystemAllocAligned(chunk, alignPages);
+    }
+#endif
+    _mappedPages += chunk;
+    if (hugePages)
+    {
+        SystemHugePages(ptr, chunk);
+    }
+
+    // 一次性开辟整段内存在页号映射中的结构：之后在这段内存上的set都不会再加锁开辟节点，
+    // 读者也就不会遇到正在开辟的节点
+    _idSpanMap.Ensure((size_t) ptr >> PAGE_SHIFT, chunk);
+
+    // 按倍数增长：下次申请翻倍，直到上限。并发时多翻一次也无妨
+    size_t maxPages = _growMaxPages;
+    if (growPages < maxPages)
+    {
+        size_t next = growPages * 2 < maxPages ? growPages * 2 : maxPages;
+        _growPages.compare_exchange_strong(growPages, next);
+    }
+
+    // 需要注意的是，span其实只是记录了页空间的信息，
+    // 而不是像自由链表的指针一样占用了块空间
+    // 这一点从span需要new就能看出。
+    Span *span = NewSpanObject();
+    span->_pageId = (size_t) ptr >> PAGE_SHIFT;
+    span->_n = npages;
+    span->_freeTime = NowMs();
+
+    if (chunk > npages)
+    {
+        // 多申请的部分还没被访问过，不占物理内存，按已归还的状态放进大块空闲集合，
+        // 之后的申请按地址从低到高依次切用，物理页（和大页）保持紧凑
+        Span *rest = NewSpanObject();
+        rest->_pageId = span->_pageId + npages;
+        rest->_n = chunk - npages;
+        rest->_isReturned = true;
+        InsertLargeSpan(rest);
+    }
+    return span;
+}
 
 
 Span *PageCache::NewSpan(size_t k)
+{
+    return NewSpanImpl<false>(k);
+}
+
+
+Span *PageCache::NewSpanLinearScan(size_t k)
+{
+    return NewSpanImpl<true>(k);
+}
+
+
+template<bool LinearScan>
+Span *PageCache::NewSpanImpl(size_t k)
 {
     /*
      * 情况1：对应槽位有非空Span，弹出首个Span给CC
      * 情况2：对应槽位无但后续槽位有，弹出后续槽位的span并分裂
      * 返回对应的span，将另一个span挂载到正确槽位
-     * 情况3：所有槽位均无，内存申请一个最大槽位的Span，后续同2
+     * 情况3：所有槽位均无，向系统申请一个新的区域，后续同2
      */
     assert(k>0 && k<PAGE_NUM);
 
-    // ①K号桶有非空Span
-    if (!_spanLists[k].Empty())
+    while (true)
     {
-        Span *span = _spanLists[k].PopFront();
-
-        // 记录【分配出去】的span地址与页号的映射关系
-        for (size_t i = 0; i < span->_n; i++)
+        bool contended = false;
+        // 用非空桶位图直接跳到 >= k 的最小非空桶，不再逐个检查空桶
+        for (size_t i = LinearScan ? FindNonEmptyBucketLinear(k) : FindNonEmptyBucket(k); i < PAGE_NUM;
+             i = LinearScan ? FindNonEmptyBucketLinear(i + 1) : FindNonEmptyBucket(i + 1))
         {
-            // _idSpanMap[span->_pageId + i] = span;
-            _idSpanMap.set(span->_pageId + i, span);
+            Span *span = PopSpanLocked(i, contended);
+            if (span != nullptr)
+            {
+                std::lock_guard<std::mutex> lg(RegionMtx(span->_pageId), std::adopt_lock);
+                return CarveSpan(span, k);
+            }
         }
-        assert(span->_pageId != 0);
-        return span;
+
+        // 有空闲span但它们所在的区域正在合并，稍后重试，避免为此多申请一整个区域
+        if (!contended)
+            break;
+        std::this_thread::yield();
     }
 
-    // ②K号后面的同有非空Span，记为n
-    for (size_t i = k + 1; i < PAGE_NUM; i++)
-    {
-        if (!_spanLists[i].Empty())
-        {
-            Span *nSpan = _spanLists[i].PopFront();
-            // 分裂产生一个新的Span，该Span节点的空间需要新建立而不是用管理的空间
-            Span *kSpan = _spanPool.New();
-            kSpan->_pageId = nSpan->_pageId;
-            kSpan->_n = k;
-            nSpan->_pageId += k; // nSpan的pageId后移K
-            nSpan->_n -= k;
-            // 在n-k桶插入，返回另一个
-            _spanLists[i - k].PushFront(nSpan);
-            // 记录nSpan的地址与页号的映射关系
-            // 在PC中，只需要记录第一页和最后一页的映射即可
-            // _idSpanMap[nSpan->_pageId] = nSpan;
-            _idSpanMap.set(nSpan->_pageId, nSpan);
-            // _idSpanMap[nSpan->_pageId + nSpan->_n - 1] = nSpan;
-            _idSpanMap.set(nSpan->_pageId + nSpan->_n - 1, nSpan);
-            // 记录Kspan的地址与页号的映射关系
-            for (size_t j = 0; j < kSpan->_n; j++)
-            {
-                // _idSpanMap[kSpan->_pageId + j] = kSpan;
-                _idSpanMap.set(kSpan->_pageId + j, kSpan);
-            }
+    // 所有桶都没有，向系统申请一个新区域
+    return NewRegionSpan(k, REGION_PAGES);
+}
 
-            return kSpan;
-        }
+
+Span *PageCache::NewAlignedSpan(size_t k, size_t alignPages)
+{
+    assert(k > 0 && k < PAGE_NUM);
+    assert(alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
+
+    // 多出来的部分超过了一个区域，直接申请一段首地址对齐的新区域，
+    // 对齐点就是起点，切下k页后剩余部分照常进入PC的桶
+    if (k + alignPages - 1 >= PAGE_NUM)
+    {
+        return NewRegionSpan(k, alignPages);
     }
 
-    // ③K号及后面都没有，向系统申请最大页数（128）
-    // 向系统申请内存
-    void *ptr = SystemAlloc(PAGE_NUM - 1);
-    // 需要注意的是，span其实只是记录了页空间的信息，
-    // 而不是像自由链表的指针一样占用了块空间
-    // 这一点从span需要new就能看出。
-    Span *bigSpan = _spanPool.New();
-    bigSpan->_pageId = (size_t) ptr >> PAGE_SHIFT; // 假设 PAGE_SHIFT 为 13
-    bigSpan->_n = PAGE_NUM - 1;
-    // 将这个大 Span 挂到最大的桶里
-    _spanLists[PAGE_NUM - 1].PushFront(bigSpan);
-    // 递归调用NewSpan
-    return NewSpan(k);
+    // 多取alignPages-1页，保证其中一定有一个对齐的起点
+    // span已标记为使用中，切下来的首尾span归还合并时会在这里停下
+    Span *span = NewSpan(k + alignPages - 1);
+
+    size_t alignedId = (span->_pageId + alignPages - 1) & ~(alignPages - 1);
+    size_t headPages = alignedId - span->_pageId;
+    size_t tailPages = span->_n - headPages - k;
+
+    Span *head = nullptr;
+    Span *tail = nullptr;
+    if (headPages > 0)
+    {
+        head = NewSpanObject();
+        head->_pageId = span->_pageId;
+        head->_n = headPages;
+        head->_isUse = true;
+    }
+    if (tailPages > 0)
+    {
+        tail = NewSpanObject();
+        tail->_pageId = alignedId + k;
+        tail->_n = tailPages;
+        tail->_isUse = true;
+    }
+
+    // span本身缩成中间对齐的k页，其映射在NewSpan中已经全部建立
+    span->_pageId = alignedId;
+    span->_n = k;
+
+    if (head)
+        ReleaseSpanToPageCache(head);
+    if (tail)
+        ReleaseSpanToPageCache(tail);
+
+    return span;
 }
 
 
@@ -80,13 +339,9 @@ Span *PageCache::MapObjectToSpan(void *obj)
 {
     size_t id = (size_t) obj >> PAGE_SHIFT;
 
-    // 这里需要对_idSpanMap进行加锁
-    // 不加锁的话，会出现 PC、CC的正在对unordered_map写入映射
-    // 而某些同时线程读取映射的情况
-    // 因此为了使代码正常运行这里必须加锁
-    // 但是！每次写入/读取映射都需要竞争锁，性能会下降的非常厉害
-    // std::unique_lock<std::mutex> Pagelg(_pageMtx);
-
+    // 基数树的读取不需要加锁：
+    // 使用中的span的每一页在分配出去之前就已经写好了映射，
+    // 释放之前这些映射都不会再改变；树的节点按release/acquire发布，见TCMalloc_PageMap3
     Span* span = (Span*)_idSpanMap.get(id);
 
     if (span != nullptr)
@@ -100,52 +355,568 @@ Span *PageCache::MapObjectToSpan(void *obj)
 }
 
 
+bool PageCache::TryGrowSpan(Span *span, size_t k)
+{
+    assert(span->_isUse);
+    assert(k > span->_n && k < PAGE_NUM);
+
+    // 扩展后不能越过所在区域的末尾
+    size_t rightID = span->_pageId + span->_n;
+    if (span->_pageId / REGION_PAGES != (span->_pageId + k - 1) / REGION_PAGES)
+        return false;
+
+    std::lock_guard<std::mutex> lg(RegionMtx(span->_pageId));
+
+    // 与ReleaseSpanToPageCache向右合并时的判断相同
+    Span *rightSpan = (Span *) _idSpanMap.get(rightID);
+    if (rightSpan == nullptr) return false;
+    if (rightSpan->_isUse) return false;
+    size_t need = k - span->_n;
+    if (rightSpan->_n < need) return false;
+
+    RemoveSpan(rightSpan);
+    // 只提交并过来的部分，剩下的保持原状态
+    if (rightSpan->_isReturned)
+    {
+        SystemCommit((void *) (rightID << PAGE_SHIFT), need);
+    }
+
+    if (rightSpan->_n == need)
+    {
+        DeleteSpanObject(rightSpan);
+    } else
+    {
+        // 右邻span剩余部分的首页后移，重新挂回对应的桶
+        rightSpan->_pageId += need;
+        rightSpan->_n -= need;
+        _idSpanMap.set(rightSpan->_pageId, rightSpan);
+        _idSpanMap.set(rightSpan->_pageId + rightSpan->_n - 1, rightSpan);
+        PushSpan(rightSpan);
+    }
+
+    // 并过来的页都映射到span，释放时任意一页都能反查
+    for (size_t i = 0; i < need; i++)
+    {
+        _idSpanMap.set(rightID + i, span);
+    }
+    span->_n = k;
+    return true;
+}
+
+
 void PageCache::ReleaseSpanToPageCache(Span *span)
 {
-    // 1.没找到相邻span停止合并，说明这页空间还没申请
+    // 1.到达区域边界停止合并，PC中的span不跨区域
     // 2.Span被CC使用停止合并
-    // 3.合并后的数值超过128停止合并，超出了PC维护的大小
-    // 4.左右两个方向
-
-    // 向左合并
-    while (1)
-    {
-        size_t leftID = span->_pageId - 1; // 左邻页
-        Span* leftSpan = (Span*)_idSpanMap.get(leftID);
-        if (leftSpan == nullptr) break; // 没找到
-        if (leftSpan->_isUse) break; // CC在用
-        if (leftSpan->_n + span->_n > PAGE_NUM - 1) break; //大于128
-
-        // 将leftSpan管理的页交给Span
-        span->_pageId = leftSpan->_pageId;
-        span->_n += leftSpan->_n;
-        // 删除leftSpan
-        _spanLists[leftSpan->_n].Erase(leftSpan); // 在对应桶中删除
-        _spanPool.Delete(leftSpan); // 删除span
-    }
-
-    // 向右合并
-    while (1)
-    {
-        size_t rightID = span->_pageId + span->_n; // 右邻页
-        Span* rightSpan = (Span*)_idSpanMap.get(rightID);
-        if (rightSpan == nullptr) break;
-        if (rightSpan->_isUse == true) break;
-        if (rightSpan->_n + span->_n > PAGE_NUM - 1) break; //大于128
-
-        // 将leftSpan管理的页交给Span
-        span->_n += rightSpan->_n;
-        // 删除leftSpan
-        _spanLists[rightSpan->_n].Erase(rightSpan); // 在对应桶中删除
-        _spanPool.Delete(rightSpan); // 删除对象
-    }
-
-    // 合并完成
-    _spanLists[span->_n].PushFront(span);
-    span->_isUse = false; // 此时该span才算是彻底回到PC的管辖
-    // 修改映射
-    // _idSpanMap[span->_pageId] = span;
+    // 3.左右两个方向
+    // 区域只有128页，合并后不会超过PC维护的最大页数
+
+    // 已归还的部分与未归还的部分合并时，统一按未归还处理，
+    // 把已归还的部分重新提交（Linux下是空操作，并不会增加RSS）
+    // 合并成完整区域的话会进入大块空闲集合，之后由ReleaseIdleSpans整体再归还一次
+
+    size_t now = NowMs();
+    bool wholeRegion = false;
+    {
+        // 合并只涉及同一区域内的相邻span，加该区域的锁即可
+        std::lock_guard<std::mutex> lg(RegionMtx(span->_pageId));
+
+        // 向左合并
+        while (span->_pageId % REGION_PAGES != 0)
+        {
+            size_t leftID = span->_pageId - 1; // 左邻页
+            Span* leftSpan = (Span*)_idSpanMap.get(leftID);
+            if (leftSpan == nullptr) break; // 没找到
+            if (leftSpan->_isUse) break; // CC在用
+
+            // 在对应桶中删除，并提交已归还的部分
+            RemoveSpan(leftSpan);
+            CommitSpan(leftSpan);
+            // 将leftSpan管理的页交给Span
+            span->_pageId = leftSpan->_pageId;
+            span->_n += leftSpan->_n;
+            // 删除leftSpan
+            DeleteSpanObject(leftSpan); // 删除span
+        }
+
+        // 向右合并
+        while ((span->_pageId + span->_n) % REGION_PAGES != 0)
+        {
+            size_t rightID = span->_pageId + span->_n; // 右邻页
+            Span* rightSpan = (Span*)_idSpanMap.get(rightID);
+            if (rightSpan == nullptr) break;
+            if (rightSpan->_isUse == true) break;
+
+            // 在对应桶中删除，并提交已归还的部分
+            RemoveSpan(rightSpan);
+            CommitSpan(rightSpan);
+            // 将rightSpan管理的页交给Span
+            span->_n += rightSpan->_n;
+            // 删除rightSpan
+            DeleteSpanObject(rightSpan); // 删除对象
+        }
+
+        // 合并完成
+        span->_isReturned = false;
+        span->_freeTime = now;
+        span->_isUse = false; // 此时该span才算是彻底回到PC的管辖
+        if (span->_n == REGION_PAGES)
+        {
+            // 整个区域都空闲了，区域内不再有别的span会来探测它，
+            // 解开区域锁后转入大块空闲集合，与相邻区域合并
+            wholeRegion = true;
+        } else
+        {
+            // 修改映射
+            _idSpanMap.set(span->_pageId, span);
+            _idSpanMap.set(span->_pageId + span->_n - 1, span);
+            PushSpan(span);
+        }
+    }
+
+    if (wholeRegion)
+    {
+        InsertLargeSpan(span);
+        return;
+    }
+    MaybeReleaseIdleSpans(now);
+}
+
+
+void PageCache::MaybeReleaseIdleSpans(size_t now, size_t keepPageId)
+{
+    // 顺带检查是否需要把空闲内存还给操作系统：
+    // 大块空闲集合中占用物理内存的字节超限时立即回收；否则每隔_releaseIdleMs按空闲时间检查一次，
+    // 用CAS保证同一时刻只有一个线程去做按时间的检查
+    // 只和集合中的页比较：桶中的span不会被回收，算进来的话碎片一多就会一直超限，每次释放都要扫一遍集合
+    size_t last = _lastReleaseTime.load(std::memory_order_relaxed);
+    if ((_largeFreePages << PAGE_SHIFT) > _retainedLimit)
+    {
+        ReleaseIdleSpans(false, keepPageId);
+    } else if (now - last >= _releaseIdleMs && _lastReleaseTime.compare_exchange_strong(last, now))
+    {
+        ReleaseIdleSpans(false, keepPageId);
+    }
+}
+
+
+size_t PageCache::ReleaseIdleSpans(bool force, size_t keepPageId)
+{
+    // 只回收大块空闲集合中的span（至少是一个完整的区域）：桶中更小的span大概率很快会被再次切分使用，
+    // 归还后马上又要缺页，得不偿失
+    // 挑选和归还分成三步：持有_largeMtx把要归还的span从集合中取出；解锁后再逐个madvise；
+    // 最后加锁放回集合，与相邻的已归还span合并。取出期间其它线程看不到这些span，最多多向系统申请一次
+    SpanList picked;
+    size_t released = 0;
+    {
+        std::lock_guard<std::mutex> lg(_largeMtx);
+        size_t now = NowMs();
+        size_t idleMs = _releaseIdleMs;
+        size_t limit = _retainedLimit;
+
+        auto it = _largeByAddr.begin();
+        while (it != _largeByAddr.end())
+        {
+            Span *span = it->second;
+            ++it; // 取出span会删掉当前节点，先移到下一个
+            if (span->_isReturned || span->_pageId == keepPageId)
+                continue;
+
+            bool idle = now - span->_freeTime >= idleMs;
+            bool overLimit = (_largeFreePages << PAGE_SHIFT) > limit;
+            if (force || idle || overLimit)
+            {
+                EraseLargeSpan(span);
+                picked.PushFront(span);
+                released += span->_n;
+            }
+        }
+    }
+    if (released == 0)
+        return 0;
+
+    for (Span *it = picked.Begin(); it != picked.End(); it = it->_next)
+    {
+        SystemDecommit((void *) (it->_pageId << PAGE_SHIFT), it->_n);
+    }
+
+    // 相邻的已归还span合并成一个，之后更大的请求也能从中切出
+    std::lock_guard<std::mutex> lg(_largeMtx);
+    while (!picked.Empty())
+    {
+        Span *span = picked.PopFront();
+        span->_isReturned = true;
+        MergeLargeSpan(span);
+    }
+    return released;
+}
+
+
+size_t PageCache::ReleaseBucketSpans()
+{
+    size_t released = 0;
+    for (size_t i = FindNonEmptyBucket(1); i < PAGE_NUM; i = FindNonEmptyBucket(i + 1))
+    {
+        // 区域锁被占用（正在切分或合并）的span跳过，显式回收只是尽力而为
+        bool contended = false;
+        Span *span;
+        while ((span = PopSpanLocked(i, contended, true)) != nullptr)
+        {
+            // 持有区域锁期间span不在桶中，相邻span的合并会等到它挂回去之后
+            std::lock_guard<std::mutex> lg(RegionMtx(span->_pageId), std::adopt_lock);
+            SystemDecommit((void *) (span->_pageId << PAGE_SHIFT), span->_n);
+            span->_isReturned = true;
+            released += span->_n;
+            // 挂到桶尾：之后NewSpan先取仍占用物理内存的span，这里下一轮查找也不用越过它
+            PushSpan(span, true);
+        }
+    }
+    return released;
+}
+
+
+void PageCache::PutLargeSpan(Span *span)
+{
+    _largeBySize.insert(std::make_pair(span->_n, span->_pageId));
+    _largeByAddr.insert(std::make_pair(span->_pageId, span));
+    if (span->_isReturned)
+    {
+        _returnedPages += span->_n;
+    } else
+    {
+        _freePages += span->_n;
+        _largeFreePages += span->_n;
+    }
+}
+
+void PageCache::EraseLargeSpan(Span *span)
+{
+    _largeBySize.erase(std::make_pair(span->_n, span->_pageId));
+    _largeByAddr.erase(span->_pageId);
+    if (span->_isReturned)
+    {
+        _returnedPages -= span->_n;
+    } else
+    {
+        _freePages -= span->_n;
+        _largeFreePages -= span->_n;
+    }
+}
+
+
+Span *PageCache::TakeLargeSpan(size_t npages, size_t alignPages)
+{
+    assert(npages > 0 && npages % REGION_PAGES == 0);
+
+    std::lock_guard<std::mutex> lg(_largeMtx);
+
+    // 页数 >= npages 的最小span，页数相同时取地址最低的
+    // 集合中的span都按区域对齐；要求更大的对齐时，继续找能容纳对齐后npages页的span
+    auto it = _largeBySize.lower_bound(std::make_pair(npages, (size_t) 0));
+    size_t start = 0;
+    for (; it != _largeBySize.end(); ++it)
+    {
+        start = (it->second + alignPages - 1) & ~(alignPages - 1);
+        if (start + npages <= it->second + it->first)
+            break;
+    }
+    if (it == _largeBySize.end())
+        return nullptr;
+
+    Span *span = _largeByAddr.find(it->second)->second;
+    EraseLargeSpan(span);
+    if (start > span->_pageId)
+    {
+        // 对齐点之前的部分留在集合中
+        Span *head = NewSpanObject();
+        head->_pageId = span->_pageId;
+        head->_n = start - span->_pageId;
+        head->_isReturned = span->_isReturned;
+        head->_freeTime = span->_freeTime;
+        span->_pageId = start;
+        span->_n -= head->_n;
+        PutLargeSpan(head);
+    }
+    if (span->_n > npages)
+    {
+        // 高地址的剩余部分留在集合中，归还状态与原span相同
+        Span *rest = NewSpanObject();
+        rest->_pageId = span->_pageId + npages;
+        rest->_n = span->_n - npages;
+        rest->_isReturned = span->_isReturned;
+        rest->_freeTime = span->_freeTime;
+        span->_n = npages;
+        PutLargeSpan(rest);
+    }
+    return span;
+}
+
+
+void PageCache::InsertLargeSpan(Span *span)
+{
+    assert(span->_pageId % REGION_PAGES == 0 && span->_n % REGION_PAGES == 0);
+
+    size_t now = NowMs();
+    size_t keepPageId;
+    {
+        std::lock_guard<std::mutex> lg(_largeMtx);
+        span->_isUse = false;
+        span->_freeTime = now;
+        MergeLargeSpan(span);
+        keepPageId = span->_pageId;
+    }
+    // 刚放进来的span（及与它合并的部分）不参与这次超限回收：
+    // 反复申请释放同一块大内存时，每次都归还会让下一次申请全部缺页
+    MaybeReleaseIdleSpans(now, keepPageId);
+}
+
+
+void PageCache::MergeLargeSpan(Span *span)
+{
+    // 只与归还状态相同的邻居合并：刚释放的内存还占着物理页，
+    // 并进一大段已归还的span会让整段都被当成占用物理内存，很快又被整体归还
+    // 集合中相邻且状态相同的span早已合并，因此每个方向最多合并一次
+    auto it = _largeByAddr.lower_bound(span->_pageId);
+    if (it != _largeByAddr.begin())
+    {
+        Span *leftSpan = std::prev(it)->second;
+        if (leftSpan->_pageId + leftSpan->_n == span->_pageId && leftSpan->_isReturned == span->_isReturned)
+        {
+            EraseLargeSpan(leftSpan);
+            span->_pageId = leftSpan->_pageId;
+            span->_n += leftSpan->_n;
+            DeleteSpanObject(leftSpan);
+        }
+    }
+
+    it = _largeByAddr.find(span->_pageId + span->_n);
+    if (it != _largeByAddr.end())
+    {
+        Span *rightSpan = it->second;
+        if (rightSpan->_isReturned == span->_isReturned)
+        {
+            EraseLargeSpan(rightSpan);
+            span->_n += rightSpan->_n;
+            DeleteSpanObject(rightSpan);
+        }
+    }
+
+    PutLargeSpan(span);
+}
+
+
+Span *PageCache::NewHugeSpan(size_t k, size_t alignPages)
+{
+    assert(k >= PAGE_NUM);
+
+    // 按完整的区域申请，优先从大块空闲集合中切
+    size_t npages = (k + REGION_PAGES - 1) / REGION_PAGES * REGION_PAGES;
+    Span *span = TakeLargeSpan(npages, alignPages > REGION_PAGES ? alignPages : REGION_PAGES);
+    if (span == nullptr)
+    {
+        span = GrowHeap(npages, alignPages);
+    }
+
+    // 只提交用到的k页，最后一个区域的尾巴保持原状态
+    bool returned = span->_isReturned;
+    if (returned)
+    {
+        SystemCommit((void *) (span->_pageId << PAGE_SHIFT), k);
+    }
+    span->_isReturned = false;
+    span->_n = k;
+    // 大对象span一直处于使用状态，防止相邻的PC span把它当成空闲span合并
+    span->_isUse = true;
+
+    // 释放时用首页反查span；最后一个区域中的span向左探测时会查到尾页，
+    // 此时_isUse为true，合并会在这里停止
     _idSpanMap.set(span->_pageId, span);
-    // _idSpanMap[span->_pageId + span->_n - 1] = span;
     _idSpanMap.set(span->_pageId + span->_n - 1, span);
+
+    if (npages > k)
+    {
+        // 最后一个区域中用不到的尾巴作为普通空闲span挂进桶里，可以继续切给小对象
+        Span *slack = NewSpanObject();
+        slack->_pageId = span->_pageId + k;
+        slack->_n = npages - k;
+        slack->_isReturned = returned;
+        slack->_freeTime = NowMs();
+
+        std::lock_guard<std::mutex> lg(RegionMtx(slack->_pageId));
+        _idSpanMap.set(slack->_pageId, slack);
+        _idSpanMap.set(slack->_pageId + slack->_n - 1, slack);
+        PushSpan(slack);
+    }
+
+    return span;
+}
+
+bool PageCache::TryGrowHugeSpan(Span *span, size_t k)
+{
+    assert(span->_n >= PAGE_NUM && k > span->_n);
+
+    size_t end = span->_pageId + span->_n;
+    size_t regionEnd = (end + REGION_PAGES - 1) / REGION_PAGES * REGION_PAGES;
+    size_t newEnd = span->_pageId + k;
+    size_t newRegionEnd = (newEnd + REGION_PAGES - 1) / REGION_PAGES * REGION_PAGES;
+    bool returned = false; // 新并入的大块空闲span是否已归还
+
+    {
+        std::unique_lock<std::mutex> regionLg;
+        Span *rightSpan = nullptr;
+        if (end != regionEnd)
+        {
+            // 1. 先看最后一个区域中紧跟其后的空闲span
+            regionLg = std::unique_lock<std::mutex>(RegionMtx(end));
+            rightSpan = (Span *) _idSpanMap.get(end);
+            if (rightSpan == nullptr || rightSpan->_isUse)
+                return false;
+
+            if (newEnd <= regionEnd)
+            {
+                // 在区域内就能扩展完，与TryGrowSpan相同
+                size_t need = newEnd - end;
+                if (rightSpan->_n < need)
+                    return false;
+
+                RemoveSpan(rightSpan);
+                if (rightSpan->_isReturned)
+                {
+                    SystemCommit((void *) (end << PAGE_SHIFT), need);
+                }
+                if (rightSpan->_n == need)
+                {
+                    DeleteSpanObject(rightSpan);
+                } else
+                {
+                    rightSpan->_pageId += need;
+                    rightSpan->_n -= need;
+                    _idSpanMap.set(rightSpan->_pageId, rightSpan);
+                    _idSpanMap.set(rightSpan->_pageId + rightSpan->_n - 1, rightSpan);
+                    PushSpan(rightSpan);
+                }
+                _idSpanMap.set(newEnd - 1, span);
+                span->_n = k;
+                return true;
+            }
+
+            // 还要越过区域边界，最后一个区域剩下的部分必须整个空闲
+            if (rightSpan->_pageId + rightSpan->_n != regionEnd)
+                return false;
+        }
+
+        // 2. 再并入紧跟在该区域之后的大块空闲span
+        {
+            std::lock_guard<std::mutex> lg(_largeMtx);
+            auto it = _largeByAddr.find(regionEnd);
+            if (it == _largeByAddr.end())
+                return false;
+            Span *nextSpan = it->second;
+            size_t need = newRegionEnd - regionEnd;
+            if (nextSpan->_n < need)
+                return false;
+
+            EraseLargeSpan(nextSpan);
+            returned = nextSpan->_isReturned;
+            if (nextSpan->_n > need)
+            {
+                // 复用nextSpan记录留在集合中的剩余部分
+                nextSpan->_pageId += need;
+                nextSpan->_n -= need;
+                PutLargeSpan(nextSpan);
+            } else
+            {
+                DeleteSpanObject(nextSpan);
+            }
+        }
+        if (returned)
+        {
+            SystemCommit((void *) (regionEnd << PAGE_SHIFT), newEnd - regionEnd);
+        }
+
+        if (rightSpan != nullptr)
+        {
+            RemoveSpan(rightSpan);
+            CommitSpan(rightSpan);
+            DeleteSpanObject(rightSpan);
+        }
+
+        _idSpanMap.set(newEnd - 1, span);
+        span->_n = k;
+    }
+
+    // 新的最后一个区域中用不到的部分挂进桶里。该区域刚从集合中取出，只有这里会访问它
+    if (newRegionEnd > newEnd)
+    {
+        Span *slack = NewSpanObject();
+        slack->_pageId = newEnd;
+        slack->_n = newRegionEnd - newEnd;
+        slack->_isReturned = returned;
+        slack->_freeTime = NowMs();
+
+        std::lock_guard<std::mutex> lg(RegionMtx(slack->_pageId));
+        _idSpanMap.set(slack->_pageId, slack);
+        _idSpanMap.set(slack->_pageId + slack->_n - 1, slack);
+        PushSpan(slack);
+    }
+    return true;
+}
+
+void PageCache::ShrinkSpan(Span *span, size_t k)
+{
+    assert(span->_isUse && k > 0 && k < span->_n);
+
+    size_t start = span->_pageId + k;
+    size_t end = span->_pageId + span->_n;
+    {
+        // 新的尾页要反查到span，切下的部分向左合并时在这里停下（超大对象span只登记了首尾页）
+        std::lock_guard<std::mutex> lg(RegionMtx(start - 1));
+        span->_n = k;
+        _idSpanMap.set(start - 1, span);
+    }
+
+    // 切下的部分在归还之前标记为使用中。它的尾页仍反查到span（原来的尾页或区域边界），
+    // 右侧空闲span向左合并时同样会停下
+    while (start < end)
+    {
+        size_t regionEnd = (start / REGION_PAGES + 1) * REGION_PAGES;
+        Span *part = NewSpanObject();
+        part->_pageId = start;
+        part->_isUse = true;
+        if (start % REGION_PAGES == 0 && end >= regionEnd)
+        {
+            // 从这里开始的完整区域一起进入大块空闲集合
+            part->_n = (end - start) / REGION_PAGES * REGION_PAGES;
+            start += part->_n;
+            InsertLargeSpan(part);
+        } else
+        {
+            part->_n = std::min(end, regionEnd) - start;
+            start += part->_n;
+            ReleaseSpanToPageCache(part);
+        }
+    }
+}
+
+
+void PageCache::ReleaseHugeSpan(Span *span)
+{
+    assert(span->_n >= PAGE_NUM);
+
+    size_t whole = span->_n / REGION_PAGES * REGION_PAGES;
+    size_t tailPages = span->_n - whole;
+    if (tailPages > 0)
+    {
+        // 最后一个不完整的区域按普通span归还，会与区域中其它空闲span合并，
+        // 凑成完整的区域时同样会进入大块空闲集合
+        Span *tail = NewSpanObject();
+        tail->_pageId = span->_pageId + whole;
+        tail->_n = tailPages;
+        tail->_isUse = true;
+        span->_n = whole;
+        ReleaseSpanToPageCache(tail);
+    }
+
+    span->_isReturned = false;
+    InsertLargeSpan(span);
 }
@@ -0,0 +1,60 @@
+#include "Stats.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+#ifdef MEMORYPOOL_PER_CPU
+#include "CpuCache.h"
+#endif
+#include <cstdio>
+
+void CollectStats(MemoryPoolStats &stats)
+{
+    stats = MemoryPoolStats();
+    ThreadCache::CollectStats(stats);
+#ifdef MEMORYPOOL_PER_CPU
+    // 每CPU缓存的槽位也是TC，已经在上面汇总；这里只补上快路径数组中的块
+    CpuCache::getInstance()->CollectStats(stats);
+#endif
+    CentralCache::getInstance()->CollectStats(stats);
+
+    PageCache *pc = PageCache::getInstance();
+    stats.pageCacheFreeBytes = pc->FreeBytes();
+    stats.returnedBytes = pc->ReturnedBytes();
+    stats.mappedBytes = pc->MappedBytes();
+
+    // 各项在不同时刻读取，相减时可能出现短暂的负数，按0处理
+    stats.committedBytes = stats.mappedBytes > stats.returnedBytes ? stats.mappedBytes - stats.returnedBytes : 0;
+    size_t freeBytes = stats.threadCacheBytes + stats.centralCacheBytes + stats.pageCacheFreeBytes;
+    stats.inUseBytes = stats.committedBytes > freeBytes ? stats.committedBytes - freeBytes : 0;
+}
+
+std::string StatsToJson(const MemoryPoolStats &stats)
+{
+    std::string json;
+    char buf[512];
+
+    snprintf(buf, sizeof(buf),
+             "{\"mapped_bytes\":%zu,\"committed_bytes\":%zu,\"in_use_bytes\":%zu,"
+             "\"thread_cache_bytes\":%zu,\"central_cache_bytes\":%zu,\"transfer_cache_bytes\":%zu,"
+             "\"page_cache_free_bytes\":%zu,\"returned_bytes\":%zu,\"classes\":[",
+             stats.mappedBytes, stats.committedBytes, stats.inUseBytes,
+             stats.threadCacheBytes, stats.centralCacheBytes, stats.transferCacheBytes,
+             stats.pageCacheFreeBytes, stats.returnedBytes);
+    json += buf;
+
+    bool first = true;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        if (stats.allocs[i] == 0 && stats.frees[i] == 0 && stats.centralObjs[i] == 0)
+            continue;
+
+        snprintf(buf, sizeof(buf),
+                 "%s{\"class\":%zu,\"size\":%zu,\"allocs\":%zu,\"frees\":%zu,\"refills\":%zu,\"central_objects\":%zu}",
+                 first ? "" : ",", i, SizeClass::Size(i),
+                 stats.allocs[i], stats.frees[i], stats.refills[i], stats.centralObjs[i]);
+        json += buf;
+        first = false;
+    }
+    json += "]}";
+    return json;
+}
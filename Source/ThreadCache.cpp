@@ -1,7 +1,123 @@
 #include "ThreadCache.h"
 #include "CentralCache.h"
 #include "PageCache.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
+std::mutex ThreadCache::_registryMtx;
+ThreadCache *ThreadCache::_registryHead = nullptr;
+ThreadCache *ThreadCache::_nextVictim = nullptr;
+size_t ThreadCache::_totalBudget = THREAD_CACHE_TOTAL_BYTES;
+size_t ThreadCache::_claimedBudget = 0;
+size_t ThreadCache::_retiredAllocs[FREE_LIST_NUM] = {};
+size_t ThreadCache::_retiredFrees[FREE_LIST_NUM] = {};
+size_t ThreadCache::_retiredRefills[FREE_LIST_NUM] = {};
+#ifdef MEMORYPOOL_REMOTE_FREE
+std::atomic<ThreadCache *> ThreadCache::_remoteOwners[REMOTE_OWNER_NUM] = {};
+uint32_t ThreadCache::_nextOwnerId = 1;
+#endif
+
+ThreadCache::ThreadCache()
+{
+#ifdef MEMORYPOOL_REMOTE_FREE
+    _remoteFree.store(nullptr, std::memory_order_relaxed);
+#endif
+
+    // 每个桶的容量是两批：慢启动结束后MaxSize最多为一批加一，留出余量给批量回收和远程释放
+    size_t total = 0;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        total += 2 * SizeClass::ClassBatch(i);
+    }
+    _slotPages = (total * sizeof(void *) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    _slots = (void **) SystemAlloc(_slotPages);
+    void **slots = _slots;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        size_t capacity = 2 * SizeClass::ClassBatch(i);
+        _freeLists[i].Init(slots, capacity);
+        slots += capacity;
+    }
+
+    std::lock_guard<std::mutex> lg(_registryMtx);
+
+    // 新TC从未分配的预算里领取最多THREAD_CACHE_MIN_BYTES；总预算已经分完时从0开始，
+    // 第一次超预算时和其它TC一样去领取或偷取。各TC的预算之和因此不超过总预算
+    // （总预算调小后，超出的部分在收回完成之前除外）
+    size_t grant = _claimedBudget < _totalBudget ? std::min(_totalBudget - _claimedBudget, THREAD_CACHE_MIN_BYTES) : 0;
+    _claimedBudget += grant;
+    _maxBytes.store(grant, std::memory_order_relaxed);
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 从上次分到的位置往后找一个空闲的编号（0保留为“没有登记”），找不到就不接收远程释放
+    for (size_t i = 1; i < REMOTE_OWNER_NUM; ++i)
+    {
+        uint32_t id = _nextOwnerId;
+        _nextOwnerId = id + 1 < REMOTE_OWNER_NUM ? id + 1 : 1;
+        if (_remoteOwners[id].load(std::memory_order_relaxed) == nullptr)
+        {
+            _ownerId = id;
+            _remoteOwners[id].store(this, std::memory_order_release);
+            break;
+        }
+    }
+#endif
+
+    // 头插进注册表
+    _nextCache = _registryHead;
+    if (_registryHead)
+        _registryHead->_prevCache = this;
+    _registryHead = this;
+}
+
+
+#ifndef _WIN32
+// TC对象的定长内存池。与CC/PC的单例一样构造在静态存储上，进程退出时不析构
+static ObjectPool<ThreadCache> &ThreadCachePool()
+{
+    alignas(ObjectPool<ThreadCache>) static char storage[sizeof(ObjectPool<ThreadCache>)];
+    static ObjectPool<ThreadCache> *pool = new(storage) ObjectPool<ThreadCache>;
+    return *pool;
+}
+
+static std::mutex &ThreadCachePoolMutex()
+{
+    static std::mutex mtx;
+    return mtx;
+}
+
+ThreadCache *ThreadCache::CreateInstance()
+{
+    static pthread_key_t key;
+    static bool keyCreated = (pthread_key_create(&key, &ThreadCache::DestroyInstance) == 0);
+
+    ThreadCache *tc = nullptr;
+    {
+        std::lock_guard<std::mutex> lg(ThreadCachePoolMutex());
+        tc = ThreadCachePool().New();
+    }
+
+    // 先写TLS再登记：pthread_setspecific在key较多时可能调用calloc，
+    // 此时再次进入getInstance要能直接拿到这个TC
+    TLSSlot() = tc;
+    if (keyCreated)
+    {
+        pthread_setspecific(key, tc);
+    }
+    return tc;
+}
+
+void ThreadCache::DestroyInstance(void *tc)
+{
+    // 析构TC时会把内存还给CC。之后本线程如果（在其它线程退出回调里）还要申请内存，
+    // 会重新创建一个TC，glibc会再调用一轮析构回调
+    TLSSlot() = nullptr;
+
+    std::lock_guard<std::mutex> lg(ThreadCachePoolMutex());
+    ThreadCachePool().Delete((ThreadCache *) tc);
+}
+#endif
 
 /**
  * @param size 线程需求的字节数
@@ -11,12 +127,23 @@ void *ThreadCache::Allocate(size_t size)
 {
     assert(size <= MAX_BYTES);
 
-    size_t alignSize = SizeClass::RoundUp(size);
     size_t index = SizeClass::Index(size);
+    size_t alignSize = SizeClass::Size(index);
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 本桶取空时先看其它线程有没有还回来的块
+    if (_freeLists[index].Empty() && _remoteFree.load(std::memory_order_relaxed) != nullptr)
+    {
+        DrainRemote();
+    }
+#endif
+
+    _allocs[index] += 1;
 
     //_freeLists[index]:指定哈希桶
     if (!_freeLists[index].Empty())
     {
+        _cachedBytes -= alignSize;
         return _freeLists[index].Pop();
     } else
     {
@@ -31,80 +158,652 @@ void ThreadCache::Deallocate(void *obj, size_t size)
     assert(obj); //回收的空间不能为空
     assert(size <= MAX_BYTES); //回收大小不能超过最大值
 
-    size_t index = SizeClass::Index(size); //找到对用桶的index
+    DeallocateByIndex(obj, SizeClass::Index(size)); //找到对用桶的index
+}
+
+void ThreadCache::DeallocateByIndex(void *obj, size_t index)
+{
+    assert(obj);
+    assert(index < FREE_LIST_NUM);
+
+    _frees[index] += 1;
+
+    size_t alignSize = SizeClass::Size(index);
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 块所在span最近被别的TC取用过，还给那个TC。编号和尺寸类登记在页号映射的同一个标记里，不用访问Span
+    uint32_t ownerId = PageCache::getInstance()->MapObjectToOwner(obj);
+    if (ownerId != 0 && ownerId != _ownerId)
+    {
+        ThreadCache *owner = _remoteOwners[ownerId].load(std::memory_order_acquire);
+        if (owner != nullptr && owner->PushRemote(obj, obj, alignSize))
+        {
+            return;
+        }
+    }
+#endif
+
     _freeLists[index].Push(obj);
+    _cachedBytes += alignSize;
 
     // 当TC桶内的块数量大于桶的MaxSize，则释放MaxSize个内存块给CC
     if (_freeLists[index].Size() >= _freeLists[index].MaxSize())
     {
-        ListTooLong(_freeLists[index], size);
+        ListTooLong(_freeLists[index], alignSize);
+    }
+
+    // 缓存总量超出本TC的预算
+    if (_cachedBytes > _maxBytes.load(std::memory_order_relaxed))
+    {
+        OverBudget();
+    }
+}
+
+void ThreadCache::AllocateBatch(size_t size, void **ptrs, size_t n)
+{
+    assert(size <= MAX_BYTES);
+
+    size_t index = SizeClass::Index(size);
+    size_t alignSize = SizeClass::Size(index);
+    FreeList &list = _freeLists[index];
+    size_t filled = 0;
+    _allocs[index] += n;
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    if (list.Size() < n && _remoteFree.load(std::memory_order_relaxed) != nullptr)
+    {
+        DrainRemote();
+    }
+#endif
+
+    // 1. 本桶缓存的块整段拷走
+    size_t cached = std::min(list.Size(), n);
+    if (cached > 0)
+    {
+        memcpy(ptrs, list.PopRange(cached), cached * sizeof(void *));
+        _cachedBytes -= cached * alignSize;
+        filled = cached;
+    }
+
+    // 2. 不够的部分直接按缺的数量向CC要，直接写进调用方的数组，每次只加一次桶锁（一个span可能给不够，再要一次）
+    while (filled < n)
+    {
+        size_t actualNum = CentralCache::getInstance()->FetchRangeObj(ptrs + filled, n - filled, alignSize, _ownerId);
+        assert(actualNum >= 1);
+        _refills[index] += 1;
+        filled += actualNum;
+    }
+}
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+namespace
+{
+    // DeallocateBatch用：同一批块通常只落在少数几页上、前后交替出现，按页号记住最近查过的编号
+    class OwnerMemo
+    {
+    private:
+        static const size_t WAYS = 4;
+        size_t _page[WAYS];
+        uint32_t _owner[WAYS] = {};
+
+    public:
+        OwnerMemo()
+        {
+            for (size_t &page: _page)
+                page = (size_t) -1;
+        }
+
+        /**
+         * @param obj 块指针
+         * @param self 调用方的编号
+         * @return 块所在页登记的TC编号，登记的是调用方自己时返回0，这样本地的块总是连成一段
+         */
+        uint32_t Get(void *obj, uint32_t self)
+        {
+            size_t page = (size_t) obj >> PAGE_SHIFT;
+            size_t way = page % WAYS;
+            if (_page[way] != page)
+            {
+                uint32_t owner = PageCache::getInstance()->MapObjectToOwner(obj);
+                _page[way] = page;
+                _owner[way] = owner == self ? 0 : owner;
+            }
+            return _owner[way];
+        }
+    };
+}
+#endif
+
+void ThreadCache::DeallocateBatch(void **ptrs, size_t n, size_t index)
+{
+    assert(index < FREE_LIST_NUM);
+    if (n == 0)
+        return;
+
+    size_t alignSize = SizeClass::Size(index);
+    FreeList &list = _freeLists[index];
+    _frees[index] += n;
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 按页号映射中的编号分段：连续属于同一个TC的块是一段，别的TC的段串成链表一次CAS推过去，
+    // 本TC的（以及没有登记、对方已关闭的）段留在本地
+    OwnerMemo memo;
+    size_t i = 0;
+    while (i < n)
+    {
+        uint32_t ownerId = memo.Get(ptrs[i], _ownerId);
+        size_t j = i + 1;
+        while (j < n && memo.Get(ptrs[j], _ownerId) == ownerId)
+        {
+            ++j;
+        }
+
+        ThreadCache *owner = nullptr;
+        if (ownerId != 0)
+        {
+            owner = _remoteOwners[ownerId].load(std::memory_order_acquire);
+        }
+        if (owner != nullptr)
+        {
+            for (size_t k = i; k + 1 < j; ++k)
+            {
+                ObjNext(ptrs[k]) = ptrs[k + 1];
+            }
+            if (owner->PushRemote(ptrs[i], ptrs[j - 1], (j - i) * alignSize))
+            {
+                i = j;
+                continue;
+            }
+        }
+
+        _cachedBytes += (j - i) * alignSize;
+        PushBatch(list, ptrs + i, j - i, alignSize);
+        i = j;
+    }
+#else
+    _cachedBytes += n * alignSize;
+    PushBatch(list, ptrs, n, alignSize);
+#endif
+
+    if (_cachedBytes > _maxBytes.load(std::memory_order_relaxed))
+    {
+        OverBudget();
+    }
+}
+
+void ThreadCache::PushBatch(FreeList &list, void *const *ptrs, size_t n, size_t alignSize)
+{
+    // 一次进来的可能超过桶的容量：按剩余容量分段拷入，每段之后整批还给CC直到回到MaxSize以内
+    // （MaxSize不超过容量，所以每轮至少还能拷入一个）
+    while (n > 0)
+    {
+        size_t chunk = std::min(n, list.Capacity() - list.Size());
+        list.PushRange(ptrs, chunk);
+        ptrs += chunk;
+        n -= chunk;
+
+        while (list.Size() >= list.MaxSize())
+        {
+            ListTooLong(list, alignSize);
+        }
+    }
+}
+
+void *ThreadCache::TryAllocate(size_t index)
+{
+    FreeList &list = _freeLists[index];
+    if (list.Empty())
+        return nullptr;
+    _allocs[index] += 1;
+    _cachedBytes -= SizeClass::Size(index);
+    return list.Pop();
+}
+
+size_t ThreadCache::TakeCached(size_t index, void **ptrs, size_t n)
+{
+    FreeList &list = _freeLists[index];
+    n = std::min(list.Size(), n);
+    if (n > 0)
+    {
+        memcpy(ptrs, list.PopRange(n), n * sizeof(void *));
+        _cachedBytes -= n * SizeClass::Size(index);
+        _allocs[index] += n;
+    }
+    return n;
+}
+
+size_t ThreadCache::BeginFetch(size_t index)
+{
+    ReleaseIdle();
+    return NextFetchNum(_freeLists[index], index);
+}
+
+void *ThreadCache::EndFetch(size_t index, void **objs, size_t n)
+{
+    assert(n >= 1);
+    _allocs[index] += 1;
+    _refills[index] += 1;
+    if (n > 1)
+    {
+        // 释放锁期间别的线程可能已经往本桶里放了块，按容量分段压入
+        size_t alignSize = SizeClass::Size(index);
+        _cachedBytes += (n - 1) * alignSize;
+        PushBatch(_freeLists[index], objs + 1, n - 1, alignSize);
+        if (_cachedBytes > _maxBytes.load(std::memory_order_relaxed))
+        {
+            OverBudget();
+        }
+    }
+    return objs[0];
+}
+
+
+bool ThreadCache::ChargeExtra(size_t extraBytes)
+{
+    // 预算是被别的线程偷走的，不能再抢回来，交给OverBudget/ReleaseIdle收缩
+    if (_shrinkPending.load(std::memory_order_relaxed))
+        return false;
+
+    while (_cachedBytes + extraBytes > _maxBytes.load(std::memory_order_relaxed))
+    {
+        if (!GrowBudget())
+            return false;
     }
+    return true;
 }
 
 
 void ThreadCache::ListTooLong(FreeList &list, size_t size)
 {
-    void *start = nullptr;
-    void *end = nullptr;
-    // 弹出数量为MaxSize
-    list.PopRange(start, end, list.MaxSize());
+    size_t batch = SizeClass::ClassBatch(SizeClass::Index(size));
+    // 弹出数量为MaxSize，但不超过一整批（NumMoveSize），也不超过桶中现有的块数
+    size_t n = std::min(std::min(list.MaxSize(), batch), list.Size());
+    // 弹出的那段数组在下次压栈之前都有效，CC直接从这里拷走，不需要再复制一次
+    void **objs = list.PopRange(n);
+    _cachedBytes -= n * size;
     // 归还空间
-    CentralCache::getInstance()->ReleaseListToSpans(start, size);
+    CentralCache::getInstance()->ReleaseRangeObj(objs, n, size);
+
+    if (list.MaxSize() < batch)
+    {
+        // 以释放为主的桶同样慢启动到一批，之后按整批归还
+        list.MaxSize()++;
+    } else if (list.MaxSize() > batch && ++list.Overages() >= THREAD_CACHE_MAX_OVERAGES)
+    {
+        // 取空时多留的批数用不上，反复溢出：减回一批
+        list.Overages() = 0;
+        list.MaxSize() -= batch;
+    }
+
+    ReleaseIdle();
 }
 
 void *ThreadCache::FetchFromCentralCache(size_t index, size_t alignSize)
 {
-    // 通过对应桶的MaxSize和人为设置的上限，双重约束
-    size_t batchNum = std::min(_freeLists[index].MaxSize(),
-                               SizeClass::NumMoveSize(alignSize));
+    ReleaseIdle();
+
+    FreeList &list = _freeLists[index];
 
-    // “慢增长”：没有达到上限，MaxSize++
-    if (batchNum == _freeLists[index].MaxSize())
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // ReleaseIdle可能刚摘取了远程释放队列，本桶因此有了块就不用再去CC
+    if (!list.Empty())
     {
-        _freeLists[index].MaxSize()++;
+        _cachedBytes -= alignSize;
+        return list.Pop();
     }
+#endif
 
-    void *start = nullptr;
-    void *end = nullptr;
+    size_t batchNum = NextFetchNum(list, index);
+
+    // CC直接把块写到桶的空闲位置上：桶此时为空，容量（两批）一定放得下
+    assert(list.Empty());
 
     // 注意这里要先调用GetInstance获取CC指针
     size_t actualNum = CentralCache::getInstance()->
-            FetchRangeObj(start, end, batchNum, alignSize);
+            FetchRangeObj(list.FreeSlots(), batchNum, alignSize, _ownerId);
 
     assert(actualNum >= 1);
+    _refills[index] += 1;
 
-    if (actualNum == 1)
+    // 栈顶的一个返回给线程，其余留在TC的桶中
+    list.Commit(actualNum);
+    void *obj = list.Pop();
+    if (actualNum > 1)
     {
-        // 如果等于1，那么这个块得直接分配个线程
-        return start;
-    } else
+        _cachedBytes += (actualNum - 1) * alignSize;
+        if (_cachedBytes > _maxBytes.load(std::memory_order_relaxed))
+        {
+            OverBudget();
+        }
+    }
+    return obj;
+}
+
+
+size_t ThreadCache::NextFetchNum(FreeList &list, size_t index)
+{
+    size_t batch = SizeClass::ClassBatch(index);
+
+    // 通过对应桶的MaxSize和人为设置的上限，双重约束
+    size_t batchNum = std::min(list.MaxSize(), batch);
+
+    if (list.MaxSize() < batch)
     {
-        // 第一个返回给线程，剩余存入TC的FreeList
-        _freeLists[index].PushRange(ObjNext(start), end, actualNum - 1);
-        return start;
+        // “慢增长”：没有达到一批，MaxSize++
+        list.MaxSize()++;
+    } else if (++list.Underflows() >= THREAD_CACHE_MAX_UNDERFLOWS)
+    {
+        // 慢启动结束后仍然频繁取空：桶里多留一批，不超过指针数组的容量
+        list.Underflows() = 0;
+        list.MaxSize() = std::min(list.MaxSize() + batch, list.Capacity());
     }
+    return batchNum;
 }
 
 
-ThreadCache::~ThreadCache()
+void ThreadCache::OverBudget()
 {
+    // 预算是被别的线程偷走才超的，不能再去抢回来，否则会互相来回偷，直接收缩
+    if (_shrinkPending.exchange(false, std::memory_order_relaxed))
+    {
+        Scavenge();
+        return;
+    }
+
+    // 预算全部分完、线程又很多时，预算很小的TC几乎每次释放都会超预算，
+    // 刚失败过就不再去全局锁下偷取，直接收缩
+    auto now = std::chrono::steady_clock::now();
+    if (now - _lastGrowFail >= std::chrono::milliseconds(THREAD_CACHE_RELEASE_MS))
+    {
+        if (GrowBudget())
+            return;
+        _lastGrowFail = now;
+    }
+    Scavenge();
+}
+
+bool ThreadCache::GrowBudget()
+{
+    std::lock_guard<std::mutex> lg(_registryMtx);
+
+    // 1. 还有未分配的预算，直接领取
+    if (_claimedBudget < _totalBudget)
+    {
+        size_t grant = std::min(_totalBudget - _claimedBudget, THREAD_CACHE_STEAL_BYTES);
+        _claimedBudget += grant;
+        _maxBytes.fetch_add(grant, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 2. 轮询其它TC，从预算还高于最小值的TC偷一个步长
+    //    被偷的TC只会被打上标记，等它下次回收内存时自己收缩（自由链表只允许本线程操作）
+    //    每次最多看THREAD_CACHE_STEAL_PROBES个，下次从停下的地方接着看：线程很多、预算都只剩最小值时，
+    //    预算为0的TC每次超预算都会来这里，不能每次都在全局锁内扫一遍所有TC
+    size_t probes = 0;
+    for (ThreadCache *it = _registryHead; it != nullptr && probes < THREAD_CACHE_STEAL_PROBES;
+         it = it->_nextCache, ++probes)
+    {
+        ThreadCache *victim = _nextVictim ? _nextVictim : _registryHead;
+        _nextVictim = victim->_nextCache;
+
+        if (victim == this)
+            continue;
+
+        size_t victimBytes = victim->_maxBytes.load(std::memory_order_relaxed);
+        if (victimBytes >= THREAD_CACHE_MIN_BYTES + THREAD_CACHE_STEAL_BYTES)
+        {
+            victim->_maxBytes.store(victimBytes - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            victim->_shrinkPending.store(true, std::memory_order_relaxed);
+            if (_claimedBudget > _totalBudget)
+            {
+                // 总预算调小后已分配的还没降下来：偷来的预算直接收回，不转给自己，总和随之回落
+                _claimedBudget -= THREAD_CACHE_STEAL_BYTES;
+                return false;
+            }
+            _maxBytes.fetch_add(THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadCache::Scavenge()
+{
+    size_t maxBytes = _maxBytes.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < FREE_LIST_NUM && _cachedBytes > maxBytes; ++i)
+    {
+        FreeList &list = _freeLists[i];
+        if (list.Empty())
+            continue;
+
+        // 每个链表还回一半（至少1个），同时把MaxSize压到同样的长度，避免马上又涨回来
+        size_t n = (list.Size() + 1) / 2;
+        size_t size = SizeClass::Size(i);
+        void **objs = list.PopRange(n);
+        _cachedBytes -= n * size;
+        if (list.MaxSize() > n)
+            list.MaxSize() = n;
+        CentralCache::getInstance()->ReleaseRangeObj(objs, n, size);
+    }
+}
+
+void ThreadCache::ReleaseIdle()
+{
+    // 预算被偷走或收回后，即使本TC从来不超预算（例如只申请不释放），也在慢路径上收缩到新的预算
+    if (_shrinkPending.load(std::memory_order_relaxed) && _shrinkPending.exchange(false, std::memory_order_relaxed))
+    {
+        Scavenge();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - _lastRelease < std::chrono::milliseconds(THREAD_CACHE_RELEASE_MS))
+        return;
+    _lastRelease = now;
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 不能只在某个桶取空时才摘取：别的线程还回来的尺寸本线程不再申请时，队列会一直变长。
+    // 摘下来的块挂回自由链表，超出的部分按MaxSize和预算还给CC（已经更新过_lastRelease，不会递归进来）
+    if (_remoteFree.load(std::memory_order_relaxed) != nullptr)
+    {
+        DrainRemote();
+    }
+#endif
+
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        FreeList &list = _freeLists[i];
+        size_t low = list.LowWater();
+        if (low > 0)
+        {
+            size_t size = SizeClass::Size(i);
+            size_t batch = SizeClass::ClassBatch(i);
+            // 整个周期都没有取过（低水位就是现在的长度）：MaxSize减半，连续空闲几个周期后桶会重新慢启动
+            bool idle = (low == list.Size());
+
+            // 低水位以下的块整个周期都没被用到，还回一半（至少1个）
+            size_t n = (low + 1) / 2;
+            void **objs = list.PopRange(n);
+            _cachedBytes -= n * size;
+            CentralCache::getInstance()->ReleaseRangeObj(objs, n, size);
+
+            if (idle)
+                list.MaxSize() = std::max(list.MaxSize() / 2, (size_t) 1);
+            else if (list.MaxSize() > batch)
+                list.MaxSize() = std::max(list.MaxSize() - batch, batch);
+        }
+        list.ResetLowWater();
+    }
+}
+
+void ThreadCache::SetTotalBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lg(_registryMtx);
+    _totalBudget = bytes;
+
+    // 调小到已分配的总和以下时，立即从各TC收回超出的部分（每个TC最多收回到最小预算），
+    // 被收回的TC打上标记，在下一次慢路径上收缩，总缓存量随之回落；
+    // 各TC都已是最小预算时收不完，剩下的部分在之后偷取预算时逐步收回
+    for (ThreadCache *tc = _registryHead; tc != nullptr && _claimedBudget > _totalBudget; tc = tc->_nextCache)
+    {
+        size_t cur = tc->_maxBytes.load(std::memory_order_relaxed);
+        if (cur <= THREAD_CACHE_MIN_BYTES)
+            continue;
+        size_t take = std::min(cur - THREAD_CACHE_MIN_BYTES, _claimedBudget - _totalBudget);
+        tc->_maxBytes.store(cur - take, std::memory_order_relaxed);
+        tc->_shrinkPending.store(true, std::memory_order_relaxed);
+        _claimedBudget -= take;
+    }
+}
+
+#ifdef MEMORYPOOL_REMOTE_FREE
+// 队列关闭后的标记。TC的内存来自定长内存池，线程退出后也不会还给系统，
+// 其它线程拿着旧的owner指针来推送时，看到这个标记就会退回本地释放
+static void *const REMOTE_CLOSED = (void *) 1;
+
+bool ThreadCache::PushRemote(void *head, void *tail, size_t bytes)
+{
+    // 先加字节数再推入，摘取方减去时不会减到负数
+    _remoteBytes.fetch_add(bytes, std::memory_order_relaxed);
+    void *old = _remoteFree.load(std::memory_order_relaxed);
+    do
+    {
+        if (old == REMOTE_CLOSED)
+        {
+            _remoteBytes.fetch_sub(bytes, std::memory_order_relaxed);
+            return false;
+        }
+        ObjNext(tail) = old;
+    } while (!_remoteFree.compare_exchange_weak(old, head, std::memory_order_release, std::memory_order_relaxed));
+    return true;
+}
+
+void ThreadCache::DrainRemote(bool close)
+{
+    // 只有本线程会摘取，整条交换出来即可，不存在ABA问题
+    void *obj = _remoteFree.exchange(close ? REMOTE_CLOSED : nullptr, std::memory_order_acquire);
+    if (obj == REMOTE_CLOSED)
+        return;
+
+    size_t bytes = 0;
+    while (obj != nullptr)
+    {
+        void *next = ObjNext(obj);
+        size_t index = PageCache::getInstance()->MapObjectToClass(obj) - 1;
+        FreeList &list = _freeLists[index];
+        list.Push(obj);
+        bytes += SizeClass::Size(index);
+        _cachedBytes += SizeClass::Size(index);
+        // 与本地释放一样，桶的长度保持在MaxSize以内（不会超出指针数组的容量）
+        if (list.Size() >= list.MaxSize())
+        {
+            ListTooLong(list, SizeClass::Size(index));
+        }
+        obj = next;
+    }
+    _remoteBytes.fetch_sub(bytes, std::memory_order_relaxed);
+
+    if (!close && _cachedBytes > _maxBytes.load(std::memory_order_relaxed))
+    {
+        OverBudget();
+    }
+}
+#endif
+
+
+size_t ThreadCache::ReleaseAll()
+{
+    size_t bytes = _cachedBytes;
     for (size_t i=0; i<FREE_LIST_NUM; i++)
     {
-        if (!_freeLists[i].Empty())
+        FreeList &list = _freeLists[i];
+        if (!list.Empty())
         {
-            void* start = nullptr;
-            void* end = nullptr;
-            size_t count = _freeLists[i].Size(); // 当前链表内存块数量
+            size_t count = list.Size(); // 当前桶内存块数量
+
+            // 将当前桶内剩余的所有内存块一口气全部弹出，桶下标已知，块大小不必再查基数树
+            void **objs = list.PopRange(count);
+
+            // 全部还给 CentralCache，完成真正的跨层回收；变空的span会在这里还给PC
+            CentralCache::getInstance()->ReleaseListToSpans(objs, count, SizeClass::Size(i));
+        }
+        // 桶重新慢启动
+        list.MaxSize() = 1;
+        list.Underflows() = 0;
+        list.Overages() = 0;
+        list.ResetLowWater();
+    }
+    _cachedBytes = 0;
+    return bytes;
+}
+
+size_t ThreadCache::Flush()
+{
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 其它线程还回来的块也一起交出去
+    DrainRemote();
+#endif
+    return ReleaseAll();
+}
 
-            // 将当前桶内剩余的所有内存块一口气全部弹出
-            _freeLists[i].PopRange(start, end, count);
 
-            // 通过第一个对象的地址，去基数树查询它所属的 Span
-            // 从而准确地知道这批内存块的单块字节数 (objSize)
-            Span* span = PageCache::getInstance()->MapObjectToSpan(start);
+ThreadCache::~ThreadCache()
+{
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 先关闭远程释放队列，已经推进来的块随自由链表一起还给CC
+    DrainRemote(true);
+#endif
+
+    ReleaseAll();
+    SystemFree(_slots, _slotPages);
+
+    // 从注册表摘除，预算交还给全局
+    std::lock_guard<std::mutex> lg(_registryMtx);
+    if (_prevCache)
+        _prevCache->_nextCache = _nextCache;
+    else
+        _registryHead = _nextCache;
+    if (_nextCache)
+        _nextCache->_prevCache = _prevCache;
+    if (_nextVictim == this)
+        _nextVictim = _nextCache;
+    _claimedBudget -= _maxBytes.load(std::memory_order_relaxed);
+#ifdef MEMORYPOOL_REMOTE_FREE
+    // 队列已经关闭，释放方之后查到这个编号会退回本地释放，编号可以分给新的TC
+    if (_ownerId != 0)
+    {
+        _remoteOwners[_ownerId].store(nullptr, std::memory_order_relaxed);
+    }
+#endif
 
-            // 将这条长链表全部还给 CentralCache，完成真正的跨层回收
-            CentralCache::getInstance()->ReleaseListToSpans(start, span->_objSize);
+    // 计数留给统计
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        _retiredAllocs[i] += _allocs[i];
+        _retiredFrees[i] += _frees[i];
+        _retiredRefills[i] += _refills[i];
+    }
+}
+
+void ThreadCache::CollectStats(MemoryPoolStats &stats)
+{
+    std::lock_guard<std::mutex> lg(_registryMtx);
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        stats.allocs[i] += _retiredAllocs[i];
+        stats.frees[i] += _retiredFrees[i];
+        stats.refills[i] += _retiredRefills[i];
+    }
+    for (ThreadCache *tc = _registryHead; tc != nullptr; tc = tc->_nextCache)
+    {
+        for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        {
+            stats.allocs[i] += tc->_allocs[i];
+            stats.frees[i] += tc->_frees[i];
+            stats.refills[i] += tc->_refills[i];
         }
+        stats.threadCacheBytes += tc->_cachedBytes;
+#ifdef MEMORYPOOL_REMOTE_FREE
+        stats.threadCacheBytes += tc->_remoteBytes.load(std::memory_order_relaxed);
+#endif
     }
 }
@@ -17,6 +17,24 @@ int main()
     cout << "==========================================================" << endl;
     BenchmarkConcurrentMalloc(n, 8, 10000);
 
+    cout << "==========================================================" << endl;
+    BenchmarkSizeClass(100000000);
+
+    cout << "==========================================================" << endl;
+    BenchmarkRealloc(10000);
+
+    cout << "==========================================================" << endl;
+    BenchmarkNewSpan(1000000);
+
+    cout << "==========================================================" << endl;
+    BenchmarkPageMap(10000000);
+
+    cout << "==========================================================" << endl;
+    BenchmarkBatch(100000);
+
+    cout << "==========================================================" << endl;
+    BenchmarkRemoteFree(10000000);
+
 
     return 0;
 }
@@ -8,6 +8,8 @@
 #include <chrono>   // 引入高精度计时库
 #include <cstdio>   // printf 需要用到
 #include <iostream>
+#include <mutex>
+#include <deque>
 
 using namespace std;
 
@@ -150,3 +152,399 @@ void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
     printf(" 🌟 真实体感总耗时 (挂钟时间，含TLS清理与OS开销)：%zu ms\n", global_cost);
     printf("=========================================================\n\n");
 }
+
+
+// 对比查表版与分支版的SizeClass::Index/RoundUp
+// ntimes 每种实现计算的次数
+void BenchmarkSizeClass(size_t ntimes)
+{
+    // 预先生成一组大小，混合各个区间，避免分支预测器记住固定模式
+    std::vector<size_t> sizes(4096);
+    size_t seed = 12345;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t r = seed >> 33;
+        // 约75%落在<=1KB，其余均匀分布在(1KB,256KB]
+        sizes[i] = (r & 3) ? (r % 1024 + 1) : (r % MAX_BYTES + 1);
+    }
+
+    size_t dummy = 0;
+
+    auto begin1 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ntimes; ++i)
+    {
+        size_t size = sizes[i & (sizes.size() - 1)];
+        dummy += SizeClass::ComputeIndex(size) + SizeClass::ComputeRoundUp(size);
+    }
+    auto end1 = std::chrono::high_resolution_clock::now();
+
+    auto begin2 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ntimes; ++i)
+    {
+        size_t size = sizes[i & (sizes.size() - 1)];
+        dummy += SizeClass::Index(size) + SizeClass::RoundUp(size);
+    }
+    auto end2 = std::chrono::high_resolution_clock::now();
+
+    double branch_ns = std::chrono::duration<double, std::nano>(end1 - begin1).count() / ntimes;
+    double table_ns = std::chrono::duration<double, std::nano>(end2 - begin2).count() / ntimes;
+
+    printf("================ SizeClass 基准测试 ================\n");
+    printf("Index + RoundUp 各计算 %zu 次:\n", ntimes);
+    printf(" -> 分支版：%.2f ns/次\n", branch_ns);
+    printf(" -> 查表版：%.2f ns/次\n", table_ns);
+    printf("=========================================================\n\n");
+
+    // 防止整个循环被优化掉
+    if (dummy == 0) printf("ignore\n");
+}
+
+
+// 对比ConcurrentRealloc与“申请+拷贝+释放”：模拟一个不断增长的缓冲区，
+// 从300KB每次增长64KB直到1MB
+// ntimes 重复增长的轮数
+void BenchmarkRealloc(size_t ntimes)
+{
+    const size_t minBytes = 300 * 1024;
+    const size_t maxBytes = 1024 * 1024;
+    const size_t step = 64 * 1024;
+
+    auto begin1 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ntimes; ++i)
+    {
+        size_t cur = minBytes;
+        char *buf = (char *) ConcurrentAlloc(cur);
+        buf[0] = (char) i;
+        while (cur + step <= maxBytes)
+        {
+            char *newBuf = (char *) ConcurrentAlloc(cur + step);
+            memcpy(newBuf, buf, cur);
+            ConcurrentFree(buf);
+            buf = newBuf;
+            cur += step;
+            buf[cur - 1] = (char) i;
+        }
+        ConcurrentFree(buf);
+    }
+    auto end1 = std::chrono::high_resolution_clock::now();
+
+    auto begin2 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ntimes; ++i)
+    {
+        size_t cur = minBytes;
+        char *buf = (char *) ConcurrentAlloc(cur);
+        buf[0] = (char) i;
+        while (cur + step <= maxBytes)
+        {
+            buf = (char *) ConcurrentRealloc(buf, cur + step);
+            cur += step;
+            buf[cur - 1] = (char) i;
+        }
+        ConcurrentFree(buf);
+    }
+    auto end2 = std::chrono::high_resolution_clock::now();
+
+    printf("================ Realloc 基准测试 ================\n");
+    printf("缓冲区从 %zuKB 按 %zuKB 增长到 %zuKB，重复 %zu 轮:\n",
+           minBytes / 1024, step / 1024, maxBytes / 1024, ntimes);
+    printf(" -> 申请+拷贝+释放：%lld ms\n",
+           (long long) std::chrono::duration_cast<std::chrono::milliseconds>(end1 - begin1).count());
+    printf(" -> ConcurrentRealloc：%lld ms\n",
+           (long long) std::chrono::duration_cast<std::chrono::milliseconds>(end2 - begin2).count());
+    printf("=========================================================\n\n");
+}
+
+
+// 在当前页堆上连续NewSpan(1)，返回平均每次的耗时（纳秒）
+// 每轮先连续NewSpan一批再统一释放，只统计NewSpan的耗时
+static double NewSpanCost(Span *(PageCache::*newSpan)(size_t), size_t ntimes, size_t &count)
+{
+    PageCache *pc = PageCache::getInstance();
+    std::vector<Span *> batch(1000);
+    double cost = 0;
+    size_t rounds = (ntimes + batch.size() - 1) / batch.size();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            batch[i] = (pc->*newSpan)(1);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        cost += std::chrono::duration<double, std::nano>(end - begin).count();
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            pc->ReleaseSpanToPageCache(batch[i]);
+        }
+    }
+    count = rounds * batch.size();
+    return cost / count;
+}
+
+// 测量碎片化页堆上NewSpan的延迟：先申请一批大span，隔一个释放一个，
+// 留下大量互不相邻、页数在[64,127]之间的空闲span，而小页数的桶全部为空，
+// 之后每次NewSpan(1)都必须越过一长串空桶才能找到可切分的span。
+// 在同一个页堆上分别用逐个桶检查（位图之前的做法）和非空桶位图查找，对比两者的耗时
+// ntimes 每种方式NewSpan的次数
+void BenchmarkNewSpan(size_t ntimes)
+{
+    PageCache *pc = PageCache::getInstance();
+
+    std::vector<Span *> spans;
+    for (size_t i = 0; i < 512; ++i)
+    {
+        spans.push_back(pc->NewSpan(64 + i % 64));
+        // 占住每个区域剩下的尾巴，保证空出来的洞不会和区域里其它空闲页合并
+        spans.push_back(pc->NewSpan(128 - (64 + i % 64)));
+    }
+    for (size_t i = 0; i < spans.size(); i += 2)
+    {
+        pc->ReleaseSpanToPageCache(spans[i]);
+    }
+
+    size_t count = 0;
+    double linear = NewSpanCost(&PageCache::NewSpanLinearScan, ntimes, count);
+    double bitmap = NewSpanCost(&PageCache::NewSpan, ntimes, count);
+
+    for (size_t i = 1; i < spans.size(); i += 2)
+    {
+        pc->ReleaseSpanToPageCache(spans[i]);
+    }
+
+    printf("================ NewSpan 基准测试 ================\n");
+    printf("碎片化页堆上 NewSpan(1) %zu 次:\n", count);
+    printf(" -> 逐个桶检查：%.2f ns/次\n", linear);
+    printf(" -> 非空桶位图：%.2f ns/次\n", bitmap);
+    printf("=========================================================\n\n");
+}
+
+
+// 查一个页号的耗时：先用真实申请到的对象地址在三种映射中登记，再按随机顺序get
+template<typename Map>
+static double LookupCost(Map &map, const std::vector<size_t> &ids, size_t ntimes, size_t &dummy)
+{
+    for (size_t id : ids)
+    {
+        map.set(id, (void *) (id | 1));
+    }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ntimes; ++i)
+    {
+        dummy += (size_t) map.get(ids[i & (ids.size() - 1)]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / ntimes;
+}
+
+// 对比不同页号映射策略：
+// 1. 三种实现的get各自的耗时（同一进程内单独构造，与PC用的那个互不影响）
+// 2. 当前编译选择的策略下，小对象ConcurrentFree的实际耗时
+// ntimes get和free的次数
+void BenchmarkPageMap(size_t ntimes)
+{
+    // 混合各种大小的对象，地址分散在许多区域中；个数取2的幂方便取模
+    std::vector<void *> objs(1 << 16);
+    std::vector<size_t> ids(objs.size());
+    size_t seed = 12345;
+    for (size_t i = 0; i < objs.size(); ++i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t r = seed >> 33;
+        objs[i] = ConcurrentAlloc((r & 3) ? (r % 1024 + 1) : (r % MAX_BYTES + 1));
+        ids[i] = (size_t) objs[i] >> PAGE_SHIFT;
+    }
+    // 打乱查找顺序
+    for (size_t i = ids.size() - 1; i > 0; --i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        std::swap(ids[i], ids[(seed >> 33) % (i + 1)]);
+    }
+
+    size_t dummy = 0;
+    auto *map1 = new TCMalloc_PageMap1<48 - PAGE_SHIFT>;
+    auto *map2 = new TCMalloc_PageMap2<48 - PAGE_SHIFT>;
+    auto *map3 = new TCMalloc_PageMap3<48 - PAGE_SHIFT>;
+    double flat_ns = LookupCost(*map1, ids, ntimes, dummy);
+    double two_ns = LookupCost(*map2, ids, ntimes, dummy);
+    double three_ns = LookupCost(*map3, ids, ntimes, dummy);
+    // 三个映射都没有析构时归还内存的逻辑，测试结束后随进程一起释放
+
+    for (size_t i = 0; i < objs.size(); ++i)
+    {
+        ConcurrentFree(objs[i]);
+    }
+
+    // 释放路径：只用小对象，释放主要走TC，查映射在其中的占比最大
+    // 每轮释放全部对象再重新申请，只统计释放的耗时
+    for (size_t i = 0; i < objs.size(); ++i)
+    {
+        objs[i] = ConcurrentAlloc(i % 1024 + 1);
+    }
+    double free_ns = 0;
+    size_t rounds = (ntimes + objs.size() - 1) / objs.size();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < objs.size(); ++i)
+        {
+            ConcurrentFree(objs[i]);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        free_ns += std::chrono::duration<double, std::nano>(end - begin).count();
+
+        for (size_t i = 0; i < objs.size(); ++i)
+        {
+            objs[i] = ConcurrentAlloc(i % 1024 + 1);
+        }
+    }
+    for (size_t i = 0; i < objs.size(); ++i)
+    {
+        ConcurrentFree(objs[i]);
+    }
+
+    printf("================ PageMap 基准测试 ================\n");
+    printf("%zu 个对象所在页号随机查找 %zu 次:\n", ids.size(), ntimes);
+    printf(" -> 平坦数组：%.2f ns/次\n", flat_ns);
+    printf(" -> 两层基数树：%.2f ns/次\n", two_ns);
+    printf(" -> 三层基数树：%.2f ns/次\n", three_ns);
+#ifdef MEMORYPOOL_ARENA
+    printf("当前PC使用地址空间预留模式的平坦数组，ConcurrentFree：%.2f ns/次\n",
+           free_ns / (rounds * objs.size()));
+#else
+    printf("当前PC使用 %d 层映射（MEMORYPOOL_PAGEMAP），ConcurrentFree：%.2f ns/次\n", MEMORYPOOL_PAGEMAP,
+           free_ns / (rounds * objs.size()));
+#endif
+    printf("=========================================================\n\n");
+
+    if (dummy == 0) printf("ignore\n");
+}
+
+
+// 对比逐个申请/释放与批量接口：模拟每个请求申请再释放一批同样大小的节点
+// ntimes 请求数
+void BenchmarkBatch(size_t ntimes)
+{
+    const size_t batch = 256;
+    const size_t size = 48;
+    std::vector<void *> ptrs(batch);
+
+    // 先各跑一轮预热TC
+    ConcurrentAllocBatch(size, ptrs.data(), batch);
+    ConcurrentFreeBatch(ptrs.data(), batch, size);
+
+    auto begin1 = std::chrono::high_resolution_clock::now();
+    for (size_t r = 0; r < ntimes; ++r)
+    {
+        for (size_t i = 0; i < batch; ++i)
+        {
+            ptrs[i] = ConcurrentAlloc(size);
+        }
+        for (size_t i = 0; i < batch; ++i)
+        {
+            ConcurrentFree(ptrs[i], size);
+        }
+    }
+    auto end1 = std::chrono::high_resolution_clock::now();
+
+    auto begin2 = std::chrono::high_resolution_clock::now();
+    for (size_t r = 0; r < ntimes; ++r)
+    {
+        ConcurrentAllocBatch(size, ptrs.data(), batch);
+        ConcurrentFreeBatch(ptrs.data(), batch, size);
+    }
+    auto end2 = std::chrono::high_resolution_clock::now();
+
+    double loop_ns = std::chrono::duration<double, std::nano>(end1 - begin1).count() / (ntimes * batch);
+    double batch_ns = std::chrono::duration<double, std::nano>(end2 - begin2).count() / (ntimes * batch);
+
+    printf("================ 批量接口 基准测试 ================\n");
+    printf("%zu 次请求，每次申请并释放 %zu 个 %zu 字节的节点:\n", ntimes, batch, size);
+    printf(" -> 逐个调用：%.2f ns/块\n", loop_ns);
+    printf(" -> 批量接口：%.2f ns/块\n", batch_ns);
+    printf("=========================================================\n\n");
+}
+
+
+// 生产者/消费者：一个线程申请，另一个线程释放，统计总耗时
+// 开启MEMORYPOOL_REMOTE_FREE时，释放方把块推回申请方的远程释放队列
+// ntimes 总共传递的块数
+void BenchmarkRemoteFree(size_t ntimes)
+{
+    const size_t batch = 1024;
+    std::mutex mtx;
+    std::deque<std::vector<void *> > queue;
+    std::atomic<bool> done{false};
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::thread producer([&]() {
+        for (size_t sent = 0; sent < ntimes; sent += batch)
+        {
+            std::vector<void *> v(batch);
+            for (size_t i = 0; i < batch; ++i)
+            {
+                v[i] = ConcurrentAlloc(64);
+                ((char *) v[i])[0] = '!';
+            }
+            // 消费者跟不上时稍等，避免堆积的块数量不断增长
+            while (true)
+            {
+                std::lock_guard<std::mutex> lg(mtx);
+                if (queue.size() < 64)
+                {
+                    queue.push_back(std::move(v));
+                    break;
+                }
+            }
+            std::this_thread::yield();
+        }
+        done = true;
+    });
+
+    std::thread consumer([&]() {
+        while (true)
+        {
+            std::vector<void *> v;
+            {
+                std::lock_guard<std::mutex> lg(mtx);
+                if (!queue.empty())
+                {
+                    v = std::move(queue.front());
+                    queue.pop_front();
+                }
+            }
+            if (v.empty())
+            {
+                if (done)
+                {
+                    std::lock_guard<std::mutex> lg(mtx);
+                    if (queue.empty())
+                        break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+            for (void *p : v)
+            {
+                ConcurrentFree(p);
+            }
+        }
+    });
+
+    producer.join();
+    consumer.join();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    printf("================ 跨线程释放 基准测试 ================\n");
+#ifdef MEMORYPOOL_REMOTE_FREE
+    printf("远程释放队列：开启\n");
+#else
+    printf("远程释放队列：关闭\n");
+#endif
+    printf("一个线程申请、另一个线程释放 %zu 个64字节的块:\n", ntimes);
+    printf(" -> %.2f ns/块\n", std::chrono::duration<double, std::nano>(end - begin).count() / ntimes);
+    printf("=========================================================\n\n");
+}
@@ -0,0 +1,167 @@
+// 并发压力测试（CMake选项 MEMORYPOOL_STRESS_TEST 打开时构建 MemoryPoolStress）
+// 多个线程同时申请/释放各种大小的块，其中一部分交给下一个线程释放，
+// 大对象和超大对象不断让PC向系统申请新内存，页号映射随之长出新的节点，
+// 同时其它线程在无锁地查询映射。配合 MEMORYPOOL_STRESS_SANITIZER=thread 构建，
+// 用ThreadSanitizer检查页号映射的发布和各层缓存之间的数据竞争
+
+#include "ConcurrentAlloc.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+
+namespace
+{
+    const size_t THREADS = 8;
+    const size_t ROUNDS = 200;
+    const size_t ALLOCS_PER_ROUND = 500;
+    const size_t KEEP = 100; // 每轮结束时每个线程保留的块数
+
+    struct Block
+    {
+        unsigned char *ptr;
+        size_t size;
+    };
+
+    // 线程之间传递块的信箱：线程i把要跨线程释放的块放进信箱(i + 1) % THREADS
+    struct Mailbox
+    {
+        std::mutex mtx;
+        std::vector<Block> blocks;
+    };
+
+    Mailbox mailboxes[THREADS];
+
+    void Check(bool cond, const char *msg)
+    {
+        if (!cond)
+        {
+            printf("压力测试失败：%s\n", msg);
+            abort();
+        }
+    }
+
+    // 块的首尾写入由大小决定的标记，释放前检查，发现被别的申请覆盖就立即失败
+    // 不超过64字节的块首部标记已经覆盖到尾部，不再单独写尾部
+    void Fill(const Block &b)
+    {
+        memset(b.ptr, (int) (b.size & 0xff), b.size < 64 ? b.size : 64);
+        if (b.size > 64)
+        {
+            b.ptr[b.size - 1] = (unsigned char) (b.size * 7);
+        }
+    }
+
+    void Verify(const Block &b)
+    {
+        Check(b.ptr[0] == (unsigned char) (b.size & 0xff), "块首部被改写");
+        Check(b.size <= 64 || b.ptr[b.size - 1] == (unsigned char) (b.size * 7), "块尾部被改写");
+    }
+
+    // 大部分是小对象，少量大对象（多页span），极少量超大对象（直接按页向PC申请）
+    size_t PickSize(std::mt19937 &rng)
+    {
+        size_t t = rng() % 100;
+        if (t < 85)
+        {
+            return rng() % 1024 + 1;
+        }
+        if (t < 97)
+        {
+            return rng() % MAX_BYTES + 1;
+        }
+        if (t < 99)
+        {
+            return MAX_BYTES + rng() % (1 << 20);
+        }
+        return (1 << 20) + rng() % (8 << 20);
+    }
+
+    void Worker(size_t id)
+    {
+        std::mt19937 rng((unsigned) id);
+        std::vector<Block> live;
+        Mailbox &next = mailboxes[(id + 1) % THREADS];
+        Mailbox &mine = mailboxes[id];
+
+        for (size_t r = 0; r < ROUNDS; ++r)
+        {
+            for (size_t i = 0; i < ALLOCS_PER_ROUND; ++i)
+            {
+                Block b;
+                b.size = PickSize(rng);
+                b.ptr = (unsigned char *) ConcurrentAlloc(b.size);
+                Fill(b);
+                live.push_back(b);
+            }
+
+            std::shuffle(live.begin(), live.end(), rng);
+            std::vector<Block> handOff;
+            while (live.size() > KEEP)
+            {
+                Block b = live.back();
+                live.pop_back();
+                Verify(b);
+                if (rng() % 2)
+                {
+                    ConcurrentFree(b.ptr);
+                }
+                else
+                {
+                    handOff.push_back(b);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(next.mtx);
+                next.blocks.insert(next.blocks.end(), handOff.begin(), handOff.end());
+            }
+
+            // 释放上一个线程交过来的块，这些块由别的线程申请
+            std::vector<Block> received;
+            {
+                std::lock_guard<std::mutex> lock(mine.mtx);
+                received.swap(mine.blocks);
+            }
+            for (const Block &b: received)
+            {
+                Verify(b);
+                ConcurrentFree(b.ptr, b.size);
+            }
+        }
+
+        for (const Block &b: live)
+        {
+            Verify(b);
+            ConcurrentFree(b.ptr);
+        }
+    }
+}
+
+int main()
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS; ++i)
+    {
+        threads.emplace_back(Worker, i);
+    }
+    for (std::thread &t: threads)
+    {
+        t.join();
+    }
+
+    // 所有线程都退出后，信箱里剩下的块由主线程释放
+    for (Mailbox &box: mailboxes)
+    {
+        for (const Block &b: box.blocks)
+        {
+            Verify(b);
+            ConcurrentFree(b.ptr);
+        }
+    }
+
+    printf("压力测试通过：%zu 个线程，每个线程 %zu 轮\n", THREADS, ROUNDS);
+    return 0;
+}
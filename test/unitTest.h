@@ -18,3 +18,15 @@ void Benchmark();
 void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds);
 
 void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds);
+
+void BenchmarkSizeClass(size_t ntimes);
+
+void BenchmarkRealloc(size_t ntimes);
+
+void BenchmarkNewSpan(size_t ntimes);
+
+void BenchmarkPageMap(size_t ntimes);
+
+void BenchmarkBatch(size_t ntimes);
+
+void BenchmarkRemoteFree(size_t ntimes);